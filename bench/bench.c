@@ -0,0 +1,208 @@
+#include <bench.h>
+#include <io.h>
+#include <memtype.h>
+#include <pci.h>
+#include <pci_snapshot.h>
+#include <perf.h>
+#include <stddef.h>
+#include <vga.h>
+#include <virtio.h>
+
+/* Upper bound on the functions the suite keeps track of */
+#define BENCH_MAX_FUNCTIONS 512
+#define PCI_EXPRESS_CAP_ID 0x10
+
+struct bench_function {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t msix_cap;
+    uint16_t vendor_id;
+};
+
+static struct bench_function functions[BENCH_MAX_FUNCTIONS];
+static uint32_t function_count = 0;
+
+static uint8_t snapshot_buffer[PCI_SNAPSHOT_SIZE(BENCH_MAX_FUNCTIONS)]
+    __attribute__((aligned(8)));
+static struct pci_snapshot *const snapshot =
+    (struct pci_snapshot *)snapshot_buffer;
+
+void bench_puts(const char *s) {
+    for (; *s; s++) {
+        io_outb(BENCH_DEBUGCON_PORT, *s);
+    }
+}
+
+/* Cycle counts are printed in hex so 32-bit builds need no 64-bit division;
+ * run-qemu.sh converts them back */
+static void bench_put_hex64(uint64_t value) {
+    char buffer[19] = "0x";
+    for (int i = 15; i >= 0; i--) {
+        int nibble = (value >> (i * 4)) & 0xF;
+        buffer[17 - i] = nibble < 10 ? ('0' + nibble) : ('A' + (nibble - 10));
+    }
+    buffer[18] = '\0';
+    bench_puts(buffer);
+}
+
+void bench_exit(uint8_t code) {
+    io_outb(BENCH_DEBUG_EXIT_PORT, code);
+}
+
+void bench_run(const char *name, void (*fn)(void)) {
+    uint64_t min = ~0ULL;
+    uint64_t total = 0;
+
+    fn();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = perf_rdtsc();
+        fn();
+        uint64_t cycles = perf_rdtsc() - start;
+        if (cycles < min) min = cycles;
+        total += cycles;
+    }
+
+    bench_puts("BENCH ");
+    bench_puts(name);
+    bench_puts(" iterations=");
+    bench_put_hex64(BENCH_ITERATIONS);
+    bench_puts(" min=");
+    bench_put_hex64(min);
+    bench_puts(" total=");
+    bench_put_hex64(total);
+    bench_puts("\n");
+}
+
+/* Discovery without output: the part of pci_enumerate that scales with the
+ * machine rather than with the console */
+static void bench_scan(void) {
+    function_count = 0;
+    struct pci_iter it;
+    struct pci_function fn;
+    pci_iter_begin(&it, NULL);
+    while (pci_iter_next(&it, &fn) && function_count < BENCH_MAX_FUNCTIONS) {
+        functions[function_count++] = (struct bench_function){
+            .bus = fn.bus,
+            .device = fn.device,
+            .function = fn.function,
+            .vendor_id = fn.vendor_id};
+    }
+}
+
+/* Early exit: the scan stops at the AHCI controller */
+static void bench_find_storage(void) {
+    struct pci_iter_filter filter = {.match = PCI_ITER_MATCH_CLASS,
+                                     .class_code = PCI_CLASS_AHCI,
+                                     .class_mask = PCI_CLASS_MASK_FULL};
+    struct pci_function fn;
+    pci_find_function(&filter, &fn);
+}
+
+static void bench_enumerate(void) { pci_enumerate(); }
+
+static void bench_snapshot_capture(void) {
+    pci_snapshot_capture(snapshot, sizeof(snapshot_buffer));
+}
+
+/* The warm boot path: what replaces pci_scan when the snapshot matches */
+static void bench_snapshot_validate(void) { pci_snapshot_validate(snapshot); }
+
+static void bench_capabilities(void) {
+    for (uint32_t i = 0; i < function_count; i++) {
+        struct bench_function *f = &functions[i];
+        f->msix_cap = pci_find_capability(f->bus, f->device, f->function,
+                                          MSIX_CAP_ID, 0);
+        pci_find_capability(f->bus, f->device, f->function, PCI_EXPRESS_CAP_ID,
+                            0);
+    }
+}
+
+/* True if the MSI-X table sits in a BAR this build can address */
+static bool bench_msix_reachable(const struct bench_function *f) {
+    uint32_t table_reg = pci_read_config(PCI_CONFIG_ADDRESS(
+        f->bus, f->device, f->function, f->msix_cap + PCI_MSIX_TABLE_OFFSET));
+    uint64_t bar = getBARAddress(f->bus, f->device, f->function,
+                                 table_reg & MSIX_BIR_MASK);
+    return bar != 0 && bar <= (uint64_t)UINTPTR_MAX;
+}
+
+/* Programs every MSI-X table entry masked, as a driver does before enabling
+ * MSI-X. Only the virtio devices that run-qemu.sh adds for the suite are
+ * touched, so tables that firmware or other code set up stay as they were.
+ * MSI-X itself is left disabled so the devices are not disturbed. */
+static void bench_msix(void) {
+    for (uint32_t i = 0; i < function_count; i++) {
+        const struct bench_function *f = &functions[i];
+        if (f->vendor_id != VIRTIO_PCI_VENDOR_ID || !f->msix_cap ||
+            !bench_msix_reachable(f)) {
+            continue;
+        }
+
+        volatile uint32_t *table =
+            getMSIXTable(f->bus, f->device, f->function, f->msix_cap);
+        uint16_t size =
+            getMSIXTableSize(f->bus, f->device, f->function, f->msix_cap);
+        for (uint16_t entry = 0; entry < size; entry++) {
+            maskMSIXVector(table, entry, true);
+            writeMSIXTableEntry(table, entry, MSI_ADDRESS(0), 0x40 + entry);
+        }
+    }
+}
+
+static void bench_print(void) {
+    set_cursor(0, 0);
+    for (int line = 0; line < ROWS - 1; line++) {
+        print("The quick brown fox jumps over the lazy dog 0123456789 "
+              "ABCDEFGHIJKLMNOPQRSTUVW\n");
+    }
+}
+
+static void bench_scroll(void) {
+    set_cursor(0, ROWS - 1);
+    for (int line = 0; line < ROWS; line++) {
+        newline();
+    }
+}
+
+static void bench_clear(void) { clear(); }
+
+void bench_run_all(void) {
+    bench_puts("BENCH_START\n");
+
+    bench_run("pci_scan", bench_scan);
+    bench_run("pci_find_storage", bench_find_storage);
+    bench_run("pci_enumerate", bench_enumerate);
+    bench_run("pci_snapshot_capture", bench_snapshot_capture);
+    bench_run("pci_snapshot_validate", bench_snapshot_validate);
+    bench_run("pci_capabilities", bench_capabilities);
+    bench_run("msix_program", bench_msix);
+    bench_run("vga_print", bench_print);
+    bench_run("vga_scroll", bench_scroll);
+    bench_run("vga_clear", bench_clear);
+
+    // The same VGA work with the text buffer write-combining. It runs last
+    // because the memory type is not switched back.
+    bool vga_wc = memtype_init() && memtype_set_vga_wc();
+    if (vga_wc) {
+        bench_run("vga_print_wc", bench_print);
+        bench_run("vga_scroll_wc", bench_scroll);
+        bench_run("vga_clear_wc", bench_clear);
+    }
+
+    uint32_t msix = 0;
+    for (uint32_t i = 0; i < function_count; i++) {
+        if (functions[i].msix_cap) msix++;
+    }
+    bench_puts("BENCH_INFO functions=");
+    bench_put_hex64(function_count);
+    bench_puts(" msix=");
+    bench_put_hex64(msix);
+    bench_puts(" vga_wc=");
+    bench_put_hex64(vga_wc);
+    bench_puts("\n");
+
+    perf_dump(PERF_SINK_DEBUGCON);
+    bench_puts("BENCH_END\n");
+    bench_exit(BENCH_EXIT_SUCCESS);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file bench.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Headless benchmark suite for the PCI and VGA libraries. Results
+ * are written to QEMU's debugcon and the suite ends the VM through
+ * isa-debug-exit, so it can run unattended under
+ * `qemu-system-x86_64 -display none`. See bench/run-qemu.sh.
+ */
+#ifndef _DSP_BENCH_H_
+#define _DSP_BENCH_H_
+
+#include <stdint.h>
+
+/* QEMU -debugcon port and -device isa-debug-exit,iobase=0xf4 port */
+#define BENCH_DEBUGCON_PORT 0xE9
+#define BENCH_DEBUG_EXIT_PORT 0xF4
+
+/* Timed iterations per benchmark, after one untimed warm-up run */
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS 16
+#endif
+
+/* Exit codes passed to bench_exit; QEMU exits with (code << 1) | 1 */
+#define BENCH_EXIT_SUCCESS 0
+#define BENCH_EXIT_FAILURE 1
+
+/**
+ * @brief Writes a string to QEMU's debugcon.
+ * @param s The string to write.
+ */
+void bench_puts(const char *s);
+
+/**
+ * @brief Runs one benchmark and reports it.
+ * Calls @p fn once to warm up, then BENCH_ITERATIONS times under rdtsc, and
+ * prints one line of the form
+ * `BENCH <name> iterations=<n> min=0x<cycles> total=0x<cycles>`.
+ * @param name The benchmark name used in the report.
+ * @param fn   The code to measure.
+ */
+void bench_run(const char *name, void (*fn)(void));
+
+/**
+ * @brief Runs the full suite and ends the VM.
+ * Covers full enumeration, capability lookup, MSI-X table programming, and
+ * console print, scroll and clear throughput. The perf counters are dumped
+ * to debugcon as well when the libraries are built with DSP_PERF.
+ */
+void bench_run_all(void);
+
+/**
+ * @brief Ends the VM through isa-debug-exit.
+ * Returns only if the device is missing.
+ * @param code BENCH_EXIT_SUCCESS or BENCH_EXIT_FAILURE.
+ */
+void bench_exit(uint8_t code);
+
+#endif
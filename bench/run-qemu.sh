@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+# Runs a kernel whose entry point calls bench_run_all() under a set of QEMU
+# machine configurations and collects the debugcon reports.
+#
+#   make bench
+#   bench/run-qemu.sh build/bench.elf [RESULTS_DIR] [BASELINE_DIR]
+#
+# Each configuration writes RESULTS_DIR/<config>.log (raw debugcon output) and
+# RESULTS_DIR/<config>.txt (one "name min_cycles avg_cycles" line per
+# benchmark). With BASELINE_DIR, min cycles are compared against the .txt
+# files there and the script fails if any benchmark got slower than
+# BENCH_TOLERANCE percent (default 10).
+set -u
+
+KERNEL=${1:?usage: run-qemu.sh KERNEL [RESULTS_DIR] [BASELINE_DIR]}
+RESULTS=${2:-bench-results}
+BASELINE=${3:-}
+QEMU=${QEMU:-qemu-system-x86_64}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+ACCEL=${BENCH_ACCEL:-tcg}
+
+# -nic none keeps the default NIC from taking slots the configs assign
+COMMON=(-kernel "$KERNEL" -display none -no-reboot -m 256M -accel "$ACCEL"
+        -nic none -device isa-debug-exit,iobase=0xf4,iosize=0x04)
+
+# Emits "-blockdev ... -device virtio-blk-pci ..." for n null-backed disks
+virtio_blk() {
+    local count=$1 bus=$2 first_addr=$3
+    for ((i = 0; i < count; i++)); do
+        local node="blk${bus}x${i}"
+        printf -- '-blockdev driver=null-co,node-name=%s ' "$node"
+        printf -- '-device virtio-blk-pci,drive=%s,bus=%s,addr=%#x,disable-legacy=on ' \
+            "$node" "$bus" $((first_addr + i))
+    done
+}
+
+virtio_net() {
+    local count=$1 bus=$2 first_addr=$3
+    for ((i = 0; i < count; i++)); do
+        printf -- '-device virtio-net-pci,bus=%s,addr=%#x,disable-legacy=on ' \
+            "$bus" $((first_addr + i))
+    done
+}
+
+# Four PCI-PCI bridges behind a PCIe-to-PCI bridge, each holding 30 devices
+bridged() {
+    printf -- '-device pcie-pci-bridge,id=pcib,bus=pcie.0,addr=0x10 '
+    for ((b = 1; b <= 4; b++)); do
+        printf -- '-device pci-bridge,id=br%d,bus=pcib,chassis_nr=%d,addr=%#x ' \
+            "$b" "$b" "$b"
+        virtio_blk 15 "br$b" 1
+        virtio_net 15 "br$b" 16
+    done
+}
+
+declare -A CONFIGS=(
+    [pc]="-M pc"
+    [q35]="-M q35"
+    [q35-virtio]="-M q35 $(virtio_blk 8 pcie.0 0x8) $(virtio_net 8 pcie.0 0x10)"
+    [q35-bridges]="-M q35 $(bridged)"
+)
+
+mkdir -p "$RESULTS"
+status=0
+
+for config in pc q35 q35-virtio q35-bridges; do
+    log="$RESULTS/$config.log"
+    # shellcheck disable=SC2086
+    timeout 600 "$QEMU" "${COMMON[@]}" -debugcon "file:$log" ${CONFIGS[$config]}
+    code=$?
+    # isa-debug-exit turns BENCH_EXIT_SUCCESS (0) into exit status 1
+    if [ "$code" -ne 1 ] || ! grep -q '^BENCH_END' "$log"; then
+        echo "$config: FAILED (qemu exit status $code)"
+        status=1
+        continue
+    fi
+
+    # Cycle counts are reported in hex
+    grep '^BENCH ' "$log" | while read -r _ name iterations min total; do
+        iterations=$((${iterations#iterations=}))
+        echo "$name $((${min#min=})) $((${total#total=} / iterations))"
+    done > "$RESULTS/$config.txt"
+    echo "== $config"
+    cat "$RESULTS/$config.txt"
+
+    if [ -n "$BASELINE" ] && [ -f "$BASELINE/$config.txt" ]; then
+        if ! awk -v tol="$TOLERANCE" -v cfg="$config" '
+                NR == FNR { base[$1] = $2; next }
+                ($1 in base) && $2 > base[$1] * (100 + tol) / 100 {
+                    printf "%s: %s regressed: %d -> %d cycles\n", cfg, $1, base[$1], $2
+                    bad = 1
+                }
+                END { exit bad }' "$BASELINE/$config.txt" "$RESULTS/$config.txt"; then
+            status=1
+        fi
+    fi
+done
+
+exit $status
@@ -0,0 +1,197 @@
+/**
+ * @file io.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Port I/O and MMIO backend shared by all libraries. By default the
+ * accessors are inline instructions for real (or emulated) hardware. Building
+ * every library file with -DDSP_HOST_SIM selects the host simulation in
+ * sim.c instead, so the libraries can run as a normal Linux program.
+ */
+#ifndef _DSP_IO_H_
+#define _DSP_IO_H_
+
+#include <stdint.h>
+
+/* State saved by io_cache_disable() and restored by io_cache_enable() */
+struct io_cache_state {
+    uintptr_t flags;
+    uintptr_t cr0;
+    uintptr_t cr4;
+};
+
+#ifdef DSP_HOST_SIM
+
+/* Implemented by the simulated machine in sim.c */
+void io_outb(uint16_t port, uint8_t value);
+uint8_t io_inb(uint16_t port);
+void io_outl(uint16_t port, uint32_t value);
+uint32_t io_inl(uint16_t port);
+void *io_map(uint64_t phys);
+void io_cpuid(uint32_t leaf, uint32_t regs[4]);
+uint64_t io_rdmsr(uint32_t msr);
+void io_wrmsr(uint32_t msr, uint64_t value);
+void io_cache_disable(struct io_cache_state *state);
+void io_cache_enable(const struct io_cache_state *state);
+
+#else
+
+/**
+ * @brief Writes an 8-bit value to an I/O port.
+ * @param port The I/O port address to write to.
+ * @param value The 8-bit value to write to the port.
+ */
+static inline void io_outb(uint16_t port, uint8_t value) {
+    __asm__ volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+/**
+ * @brief Reads an 8-bit value from an I/O port.
+ * @param port The I/O port address to read from.
+ * @return The 8-bit value read from the port.
+ */
+static inline uint8_t io_inb(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+/**
+ * @brief Writes a 32-bit value to an I/O port.
+ * @param port The I/O port address to write to.
+ * @param value The 32-bit value to write to the port.
+ */
+static inline void io_outl(uint16_t port, uint32_t value) {
+    __asm__ volatile(
+        "movw %w1, %%dx\n\t"  // Move port to DX
+        "movl %0, %%eax\n\t"  // Move value to EAX
+        "outl %%eax, %%dx"    // Output EAX to DX port
+        :
+        : "r"(value), "r"(port)
+        : "%eax", "%dx");
+}
+
+/**
+ * @brief Reads a 32-bit value from an I/O port.
+ * @param port The I/O port address to read from.
+ * @return The 32-bit value read from the port.
+ */
+static inline uint32_t io_inl(uint16_t port) {
+    uint32_t value;
+    __asm__ volatile(
+        "movw %w1, %%dx\n\t"   // Move port to DX
+        "inl %%dx, %%eax\n\t"  // Input from DX port to EAX
+        "movl %%eax, %0"       // Move EAX to output variable
+        : "=r"(value)
+        : "r"(port)
+        : "%eax", "%dx");
+    return value;
+}
+
+/**
+ * @brief Returns a pointer through which a physical (MMIO) address can be
+ * accessed. The library runs identity mapped, so this is a cast.
+ * @param phys The physical address.
+ * @return The address as a pointer.
+ */
+static inline void *io_map(uint64_t phys) { return (void *)(uintptr_t)phys; }
+
+/**
+ * @brief Executes CPUID.
+ * @param leaf The leaf (EAX), with subleaf 0.
+ * @param regs Receives EAX, EBX, ECX and EDX.
+ */
+static inline void io_cpuid(uint32_t leaf, uint32_t regs[4]) {
+    __asm__ volatile("cpuid"
+                     : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]),
+                       "=d"(regs[3])
+                     : "a"(leaf), "c"(0));
+}
+
+/**
+ * @brief Reads a model specific register.
+ * @param msr The MSR index.
+ * @return The 64-bit value of the MSR.
+ */
+static inline uint64_t io_rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief Writes a model specific register.
+ * @param msr The MSR index.
+ * @param value The 64-bit value to write.
+ */
+static inline void io_wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr"
+                     :
+                     : "c"(msr), "a"((uint32_t)value),
+                       "d"((uint32_t)(value >> 32))
+                     : "memory");
+}
+
+#define IO_CR4_PGE (1u << 7)
+
+/* Reloads CR3; with CR4.PGE clear this flushes global pages too */
+static inline void io_flush_tlb(void) {
+    uintptr_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+/**
+ * @brief Enters no-fill cache mode before MTRRs or the PAT are changed.
+ * Disables interrupts, sets CR0.CD, writes back and invalidates the caches,
+ * clears CR4.PGE and flushes the TLBs, as the Intel SDM requires (section
+ * 12.11.7.2). PGE stays clear until io_cache_enable().
+ * @param state Receives the state to restore.
+ */
+static inline void io_cache_disable(struct io_cache_state *state) {
+    __asm__ volatile("pushf\n\t"
+                     "pop %0\n\t"
+                     "cli"
+                     : "=r"(state->flags)
+                     :
+                     : "memory");
+    __asm__ volatile("mov %%cr0, %0" : "=r"(state->cr0));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(state->cr4));
+    // CD = 1, NW = 0
+    __asm__ volatile("mov %0, %%cr0"
+                     :
+                     : "r"((state->cr0 | (1u << 30)) & ~(1u << 29))
+                     : "memory");
+    __asm__ volatile("wbinvd" : : : "memory");
+    if (state->cr4 & IO_CR4_PGE) {
+        __asm__ volatile("mov %0, %%cr4"
+                         :
+                         : "r"(state->cr4 & ~(uintptr_t)IO_CR4_PGE)
+                         : "memory");
+    }
+    io_flush_tlb();
+}
+
+/**
+ * @brief Leaves no-fill cache mode after MTRRs or the PAT were changed.
+ * Flushes the caches and TLBs again, then restores CR0, CR4.PGE and the
+ * interrupt flag, in that order.
+ * @param state The state saved by io_cache_disable().
+ */
+static inline void io_cache_enable(const struct io_cache_state *state) {
+    __asm__ volatile("wbinvd" : : : "memory");
+    io_flush_tlb();
+    __asm__ volatile("mov %0, %%cr0" : : "r"(state->cr0) : "memory");
+    if (state->cr4 & IO_CR4_PGE) {
+        __asm__ volatile("mov %0, %%cr4" : : "r"(state->cr4) : "memory");
+    }
+    __asm__ volatile("push %0\n\t"
+                     "popf"
+                     :
+                     : "r"(state->flags)
+                     : "memory", "cc");
+}
+
+#endif
+
+#endif
@@ -0,0 +1,445 @@
+#include <io.h>
+#include <sim.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Ports the simulated machine decodes */
+#define SIM_CONFIG_ADDRESS_PORT 0x0CF8
+#define SIM_CONFIG_DATA_PORT 0x0CFC
+#define SIM_DEBUGCON_PORT 0xE9
+#define SIM_DEBUG_EXIT_PORT 0xF4
+#define SIM_SERIAL_PORT 0x3F8
+#define SIM_SERIAL_LSR (SIM_SERIAL_PORT + 5)
+#define SIM_SERIAL_THRE (1 << 5)
+
+/* MSRs of the simulated CPU */
+#define SIM_MSR_MTRRCAP 0xFE
+#define SIM_MSR_PAT 0x277
+#define SIM_MSR_MTRR_DEF_TYPE 0x2FF
+#define SIM_MSR_MTRR_FIRST 0x200
+#define SIM_MSR_MTRR_LAST 0x26F
+#define SIM_MAX_MSRS 64
+
+#define SIM_VGA_BASE 0xB8000ULL
+#define SIM_CAP_START 0x40
+#define SIM_BAR_ALIGN 4096
+
+struct sim_function {
+    uint16_t bdf;
+    uint8_t next_cap;
+    uint8_t config[256];
+    /* Size of each memory BAR, 0 when the BAR is not implemented */
+    uint32_t bar_size[6];
+};
+
+struct sim_region {
+    uint64_t phys;
+    uint32_t size;
+    uint8_t *mem;
+};
+
+uint16_t sim_vga_buffer[SIM_VGA_CELLS];
+
+static struct sim_function sim_functions[SIM_MAX_FUNCTIONS];
+static int sim_function_count = 0;
+/* bus << 8 | device << 3 | function -> handle + 1, 0 when absent */
+static uint16_t sim_index[65536];
+
+static struct sim_region sim_regions[SIM_MAX_REGIONS];
+static int sim_region_count = 0;
+static uint64_t sim_next_mmio = SIM_MMIO_BASE;
+static uint64_t sim_next_ram = SIM_RAM_BASE;
+
+static uint32_t sim_config_address = 0;
+static struct sim_stats sim_stats;
+
+struct sim_msr {
+    uint32_t index;
+    uint64_t value;
+};
+
+static struct sim_msr sim_msrs[SIM_MAX_MSRS];
+static int sim_msr_count = 0;
+static bool sim_caches_disabled = false;
+
+static uint16_t sim_bdf(uint8_t bus, uint8_t device, uint8_t function) {
+    return (bus << 8) | ((device & 0x1F) << 3) | (function & 0x7);
+}
+
+static struct sim_function *sim_lookup(uint16_t bdf) {
+    uint16_t handle = sim_index[bdf];
+    return handle ? &sim_functions[handle - 1] : NULL;
+}
+
+static struct sim_function *sim_get(int fn) {
+    if (fn < 0 || fn >= sim_function_count) return NULL;
+    return &sim_functions[fn];
+}
+
+static void sim_put32(uint8_t *config, uint8_t offset, uint32_t value) {
+    memcpy(&config[offset], &value, sizeof(value));
+}
+
+static struct sim_msr *sim_find_msr(uint32_t index) {
+    for (int i = 0; i < sim_msr_count; i++) {
+        if (sim_msrs[i].index == index) return &sim_msrs[i];
+    }
+    return NULL;
+}
+
+static void sim_set_msr(uint32_t index, uint64_t value) {
+    struct sim_msr *msr = sim_find_msr(index);
+    if (!msr) {
+        if (sim_msr_count >= SIM_MAX_MSRS) abort();
+        msr = &sim_msrs[sim_msr_count++];
+        msr->index = index;
+    }
+    msr->value = value;
+}
+
+/* What SeaBIOS leaves behind on QEMU: write-back by default, the legacy VGA
+ * window uncached and the 32-bit PCI hole uncached through MTRR 0 */
+static void sim_reset_msrs(void) {
+    sim_msr_count = 0;
+    sim_caches_disabled = false;
+    // 8 variable MTRRs, fixed ranges, WC supported
+    sim_set_msr(SIM_MSR_MTRRCAP, 8 | (1 << 8) | (1 << 10));
+    sim_set_msr(SIM_MSR_PAT, 0x0007040600070406ULL);
+    sim_set_msr(SIM_MSR_MTRR_DEF_TYPE, (1 << 11) | (1 << 10) | 0x06);
+    sim_set_msr(0x250, 0x0606060606060606ULL);
+    sim_set_msr(0x258, 0x0606060606060606ULL);
+    sim_set_msr(0x259, 0);
+    for (uint32_t msr = 0x268; msr <= 0x26F; msr++) {
+        sim_set_msr(msr, 0x0606060606060606ULL);
+    }
+    for (uint32_t msr = 0x200; msr < 0x210; msr++) {
+        sim_set_msr(msr, 0);
+    }
+    sim_set_msr(0x200, SIM_MMIO_BASE | 0x00);
+    // 1 GiB at 0xC0000000 with 36 physical address bits
+    sim_set_msr(0x201, 0xFC0000000ULL | (1 << 11));
+}
+
+void sim_reset(void) {
+    for (int i = 0; i < sim_region_count; i++) {
+        free(sim_regions[i].mem);
+    }
+    memset(sim_regions, 0, sizeof(sim_regions));
+    memset(sim_functions, 0, sizeof(sim_functions));
+    memset(sim_index, 0, sizeof(sim_index));
+    memset(sim_vga_buffer, 0, sizeof(sim_vga_buffer));
+    sim_region_count = 0;
+    sim_function_count = 0;
+    sim_next_mmio = SIM_MMIO_BASE;
+    sim_next_ram = SIM_RAM_BASE;
+    sim_config_address = 0;
+    sim_reset_msrs();
+    sim_reset_stats();
+}
+
+int sim_add_function(uint8_t bus, uint8_t device, uint8_t function,
+                     uint16_t vendor_id, uint16_t device_id,
+                     uint32_t class_code) {
+    uint16_t bdf = sim_bdf(bus, device, function);
+    if (sim_function_count >= SIM_MAX_FUNCTIONS || sim_lookup(bdf)) {
+        return -1;
+    }
+
+    int handle = sim_function_count++;
+    struct sim_function *f = &sim_functions[handle];
+    memset(f, 0, sizeof(*f));
+    f->bdf = bdf;
+    f->next_cap = SIM_CAP_START;
+    sim_put32(f->config, 0x00, ((uint32_t)device_id << 16) | vendor_id);
+    // Revision 0, then prog-if, subclass, class
+    sim_put32(f->config, 0x08, class_code << 8);
+    sim_index[bdf] = handle + 1;
+
+    // Function 0 advertises the other functions of the device
+    struct sim_function *f0 = sim_lookup(sim_bdf(bus, device, 0));
+    if (function != 0 && f0) {
+        f0->config[0x0E] |= 0x80;
+    }
+    for (uint8_t other = 1; function == 0 && other < 8; other++) {
+        if (sim_lookup(sim_bdf(bus, device, other))) {
+            f->config[0x0E] |= 0x80;
+            break;
+        }
+    }
+    return handle;
+}
+
+int sim_add_bridge(uint8_t bus, uint8_t device, uint8_t function,
+                   uint8_t secondary, uint8_t subordinate) {
+    // QEMU's own PCI-PCI bridge IDs
+    int handle =
+        sim_add_function(bus, device, function, 0x1B36, 0x0001, 0x060400);
+    if (handle < 0) return -1;
+
+    uint8_t *config = sim_functions[handle].config;
+    config[0x0E] = (config[0x0E] & 0x80) | 0x01;
+    config[0x18] = bus;
+    config[0x19] = secondary;
+    config[0x1A] = subordinate;
+    return handle;
+}
+
+uint8_t sim_add_capability(int fn, uint8_t cap_id, const void *body,
+                           uint8_t len) {
+    struct sim_function *f = sim_get(fn);
+    if (!f) return 0;
+
+    uint32_t offset = f->next_cap;
+    uint32_t total = (2u + len + 3u) & ~3u;
+    if (offset == 0 || offset + total > sizeof(f->config)) return 0;
+
+    f->config[offset] = cap_id;
+    f->config[offset + 1] = 0;
+    if (body) memcpy(&f->config[offset + 2], body, len);
+
+    // Link at the tail of the chain
+    if (f->config[0x34] == 0) {
+        f->config[0x34] = offset;
+    } else {
+        uint8_t tail = f->config[0x34];
+        while (f->config[tail + 1]) tail = f->config[tail + 1];
+        f->config[tail + 1] = offset;
+    }
+    f->config[0x06] |= 0x10;  // Status: Capabilities List
+    f->next_cap = offset + total < sizeof(f->config) ? offset + total : 0;
+    return offset;
+}
+
+/* Backs the next naturally aligned power-of-two block at *next (at least
+ * SIM_BAR_ALIGN bytes) below @p limit with zeroed host memory */
+static uint64_t sim_add_region(uint64_t *next, uint64_t limit, uint32_t size,
+                               uint32_t *region_size) {
+    if (sim_region_count >= SIM_MAX_REGIONS) return 0;
+
+    uint32_t aligned = SIM_BAR_ALIGN;
+    while (aligned < size) aligned <<= 1;
+    uint64_t phys = (*next + aligned - 1) & ~(uint64_t)(aligned - 1);
+    if (phys + aligned > limit) return 0;
+
+    uint8_t *mem = calloc(1, aligned);
+    if (!mem) return 0;
+    sim_regions[sim_region_count++] =
+        (struct sim_region){.phys = phys, .size = aligned, .mem = mem};
+    *next = phys + aligned;
+    if (region_size) *region_size = aligned;
+    return phys;
+}
+
+uint64_t sim_add_bar(int fn, uint8_t bar, uint32_t size, bool prefetchable) {
+    struct sim_function *f = sim_get(fn);
+    if (!f || bar >= 6) return 0;
+
+    uint64_t phys = sim_add_region(&sim_next_mmio, 0x100000000ULL, size,
+                                   &f->bar_size[bar]);
+    if (!phys) return 0;
+
+    sim_put32(f->config, 0x10 + bar * 4,
+              (uint32_t)phys | (prefetchable ? 0x8 : 0));
+    return phys;
+}
+
+uint8_t sim_add_msix(int fn, uint16_t table_size, uint8_t bar) {
+    struct sim_function *f = sim_get(fn);
+    if (!f || table_size == 0 || table_size > 2048 || bar >= 6) return 0;
+
+    uint32_t table_bytes = 16u * table_size;
+    uint32_t pba_offset = (table_bytes + 7) & ~7u;
+    uint32_t pba_bytes = 8u * ((table_size + 63) / 64);
+
+    uint32_t bar_value;
+    memcpy(&bar_value, &f->config[0x10 + bar * 4], sizeof(bar_value));
+    uint64_t phys = bar_value & ~0xFu;
+    if (!phys) phys = sim_add_bar(fn, bar, pba_offset + pba_bytes, false);
+    // The table and PBA must fit the BAR's backing buffer
+    if (!phys || f->bar_size[bar] < pba_offset + pba_bytes) return 0;
+
+    uint32_t *table = io_map(phys);
+    for (uint16_t entry = 0; entry < table_size; entry++) {
+        table[entry * 4 + 3] = 1;  // Vectors come out of reset masked
+    }
+
+    uint8_t body[10];
+    uint16_t control = table_size - 1;
+    uint32_t table_reg = bar;
+    uint32_t pba_reg = pba_offset | bar;
+    memcpy(&body[0], &control, 2);
+    memcpy(&body[2], &table_reg, 4);
+    memcpy(&body[6], &pba_reg, 4);
+    return sim_add_capability(fn, 0x11, body, sizeof(body));
+}
+
+uint8_t *sim_config(int fn) {
+    struct sim_function *f = sim_get(fn);
+    return f ? f->config : NULL;
+}
+
+const struct sim_stats *sim_get_stats(void) { return &sim_stats; }
+
+uint64_t sim_add_ram(uint32_t size) {
+    return sim_add_region(&sim_next_ram, SIM_MMIO_BASE, size, NULL);
+}
+
+void sim_reset_stats(void) { memset(&sim_stats, 0, sizeof(sim_stats)); }
+
+static struct sim_function *sim_config_target(void) {
+    if (!(sim_config_address & 0x80000000)) return NULL;
+    return sim_lookup((sim_config_address >> 8) & 0xFFFF);
+}
+
+void io_outb(uint16_t port, uint8_t value) {
+    sim_stats.port_writes++;
+    switch (port) {
+        case SIM_DEBUGCON_PORT:
+        case SIM_SERIAL_PORT:
+            sim_stats.debugcon_bytes++;
+            fputc(value, stdout);
+            break;
+        case SIM_DEBUG_EXIT_PORT:
+            // Same exit status as QEMU's isa-debug-exit
+            fflush(stdout);
+            exit((value << 1) | 1);
+        default:
+            break;
+    }
+}
+
+uint8_t io_inb(uint16_t port) {
+    sim_stats.port_reads++;
+    // The simulated UART can always take another byte
+    return port == SIM_SERIAL_LSR ? SIM_SERIAL_THRE : 0xFF;
+}
+
+void io_outl(uint16_t port, uint32_t value) {
+    sim_stats.port_writes++;
+    if (port == SIM_CONFIG_ADDRESS_PORT) {
+        sim_config_address = value;
+        return;
+    }
+    if (port != SIM_CONFIG_DATA_PORT) return;
+
+    sim_stats.config_writes++;
+    struct sim_function *f = sim_config_target();
+    if (!f) return;
+
+    uint8_t offset = sim_config_address & 0xFC;
+    // BARs only implement the address bits above their size
+    uint8_t bars = (f->config[0x0E] & 0x7F) == 0x01 ? 2 : 6;
+    if (offset >= 0x10 && offset < 0x10 + bars * 4) {
+        uint32_t size = f->bar_size[(offset - 0x10) / 4];
+        uint32_t flags;
+        memcpy(&flags, &f->config[offset], sizeof(flags));
+        value = size ? (value & ~(size - 1)) | (flags & 0xF) : 0;
+        sim_put32(f->config, offset, value);
+        return;
+    }
+
+    uint8_t bytes[4];
+    memcpy(bytes, &value, sizeof(bytes));
+    for (int i = 0; i < 4; i++) {
+        uint8_t reg = offset + i;
+        // IDs, class, header type, capability pointer and status are
+        // read-only (status bits are write-1-to-clear)
+        if (reg < 0x04 || (reg >= 0x06 && reg < 0x0C) || reg == 0x0E ||
+            reg == 0x34) {
+            continue;
+        }
+        f->config[reg] = bytes[i];
+    }
+}
+
+uint32_t io_inl(uint16_t port) {
+    sim_stats.port_reads++;
+    if (port != SIM_CONFIG_DATA_PORT) return 0xFFFFFFFF;
+
+    sim_stats.config_reads++;
+    struct sim_function *f = sim_config_target();
+    if (!f) return 0xFFFFFFFF;
+
+    uint32_t value;
+    memcpy(&value, &f->config[sim_config_address & 0xFC], sizeof(value));
+    return value;
+}
+
+void io_cpuid(uint32_t leaf, uint32_t regs[4]) {
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    switch (leaf) {
+        case 0x00000000:
+            regs[0] = 1;
+            break;
+        case 0x00000001:
+            // MTRR, PAT, SSE, SSE2
+            regs[3] = (1 << 12) | (1 << 16) | (1 << 25) | (1 << 26);
+            break;
+        case 0x80000000:
+            regs[0] = 0x80000008;
+            break;
+        case 0x80000008:
+            regs[0] = 36;  // Physical address bits
+            break;
+        default:
+            break;
+    }
+}
+
+uint64_t io_rdmsr(uint32_t msr) {
+    sim_stats.msr_reads++;
+    struct sim_msr *entry = sim_find_msr(msr);
+    if (!entry) {
+        fprintf(stderr, "sim: rdmsr of unknown MSR 0x%x\n", msr);
+        abort();
+    }
+    return entry->value;
+}
+
+void io_wrmsr(uint32_t msr, uint64_t value) {
+    sim_stats.msr_writes++;
+    struct sim_msr *entry = sim_find_msr(msr);
+    if (!entry || msr == SIM_MSR_MTRRCAP) {
+        fprintf(stderr, "sim: wrmsr of unknown or read-only MSR 0x%x\n", msr);
+        abort();
+    }
+    // Memory types may only change with the caches disabled
+    bool memory_type = msr == SIM_MSR_PAT || msr == SIM_MSR_MTRR_DEF_TYPE ||
+                       (msr >= SIM_MSR_MTRR_FIRST && msr <= SIM_MSR_MTRR_LAST);
+    if (memory_type && !sim_caches_disabled) {
+        fprintf(stderr, "sim: MSR 0x%x written with the caches enabled\n", msr);
+        abort();
+    }
+    if (memory_type) sim_stats.memory_type_writes++;
+    entry->value = value;
+}
+
+void io_cache_disable(struct io_cache_state *state) {
+    state->flags = state->cr0 = state->cr4 = 0;
+    sim_caches_disabled = true;
+    sim_stats.cache_flushes++;
+}
+
+void io_cache_enable(const struct io_cache_state *state) {
+    (void)state;
+    sim_caches_disabled = false;
+    sim_stats.cache_flushes++;
+}
+
+void *io_map(uint64_t phys) {
+    sim_stats.mmio_maps++;
+    if (phys >= SIM_VGA_BASE &&
+        phys < SIM_VGA_BASE + sizeof(sim_vga_buffer)) {
+        return (uint8_t *)sim_vga_buffer + (phys - SIM_VGA_BASE);
+    }
+    for (int i = 0; i < sim_region_count; i++) {
+        struct sim_region *region = &sim_regions[i];
+        if (phys >= region->phys && phys < region->phys + region->size) {
+            return region->mem + (phys - region->phys);
+        }
+    }
+    fprintf(stderr, "sim: access to unmapped physical address 0x%llx\n",
+            (unsigned long long)phys);
+    abort();
+}
@@ -0,0 +1,138 @@
+/**
+ * @file sim.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Host simulation backend, selected with -DDSP_HOST_SIM. Provides a
+ * programmable PCI configuration space behind ports 0xCF8/0xCFC (functions,
+ * bridges, capability chains, BARs and MSI-X tables), an in-memory VGA text
+ * buffer, QEMU's debugcon and isa-debug-exit ports, the PAT and MTRRs as
+ * SeaBIOS leaves them, and counters for every simulated access.
+ */
+#ifndef _DSP_SIM_H_
+#define _DSP_SIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIM_MAX_FUNCTIONS 1024
+#define SIM_MAX_REGIONS 256
+/* Simulated BARs are handed out from this physical window */
+#define SIM_MMIO_BASE 0xC0000000ULL
+/* Memory from sim_add_ram() is handed out from here up */
+#define SIM_RAM_BASE 0x00200000ULL
+/* 80x25 text cells, the size of the VGA text buffer */
+#define SIM_VGA_CELLS (80 * 25)
+
+/* Access counters; port_* count every simulated port access */
+struct sim_stats {
+    uint64_t port_reads;
+    uint64_t port_writes;
+    uint64_t config_reads;
+    uint64_t config_writes;
+    uint64_t mmio_maps;
+    uint64_t debugcon_bytes;
+    uint64_t msr_reads;
+    uint64_t msr_writes;
+    /* wbinvd executed by io_cache_disable() and io_cache_enable() */
+    uint64_t cache_flushes;
+    /* MTRR and PAT writes; each one outside io_cache_disable() aborts */
+    uint64_t memory_type_writes;
+};
+
+/* The simulated VGA text buffer, used by vga.c instead of 0xB8000 */
+extern uint16_t sim_vga_buffer[SIM_VGA_CELLS];
+
+/**
+ * @brief Removes all functions and MMIO regions, clears the counters, the
+ * VGA buffer and the latched config address, and resets the MSRs.
+ */
+void sim_reset(void);
+
+/**
+ * @brief Adds a function (type 0 header) to the configuration space.
+ * Function 0 of a device is marked multi-function as soon as another
+ * function of the same device exists.
+ * @param bus        The bus number.
+ * @param device     The device number.
+ * @param function   The function number.
+ * @param vendor_id  The Vendor ID.
+ * @param device_id  The Device ID.
+ * @param class_code Class, subclass and prog-if as 0xCCSSPP.
+ * @return A handle for the other sim_* calls, or -1 if the table is full or
+ * the function exists.
+ */
+int sim_add_function(uint8_t bus, uint8_t device, uint8_t function,
+                     uint16_t vendor_id, uint16_t device_id,
+                     uint32_t class_code);
+
+/**
+ * @brief Adds a PCI-to-PCI bridge (type 1 header, class 0x0604).
+ * @param bus         The bus number of the bridge.
+ * @param device      The device number of the bridge.
+ * @param function    The function number of the bridge.
+ * @param secondary   The bus number behind the bridge.
+ * @param subordinate The highest bus number behind the bridge.
+ * @return A handle, or -1 on failure.
+ */
+int sim_add_bridge(uint8_t bus, uint8_t device, uint8_t function,
+                   uint8_t secondary, uint8_t subordinate);
+
+/**
+ * @brief Appends a capability to the capability chain of a function.
+ * @param fn     The function handle.
+ * @param cap_id The capability ID.
+ * @param body   The capability contents after the ID/next bytes, or NULL.
+ * @param len    The length of @p body in bytes.
+ * @return The config space offset of the capability, or 0 if it does not fit.
+ */
+uint8_t sim_add_capability(int fn, uint8_t cap_id, const void *body,
+                           uint8_t len);
+
+/**
+ * @brief Gives a function a 32-bit memory BAR backed by host memory.
+ * @param fn           The function handle.
+ * @param bar          The BAR index (0 to 5).
+ * @param size         The size of the BAR in bytes.
+ * @param prefetchable true to set the prefetchable bit.
+ * @return The simulated physical address of the BAR, or 0 on failure.
+ */
+uint64_t sim_add_bar(int fn, uint8_t bar, uint32_t size, bool prefetchable);
+
+/**
+ * @brief Adds an MSI-X capability whose table and PBA live in @p bar.
+ * The BAR is created if the function does not have it yet. An existing BAR
+ * must be big enough for the table and PBA.
+ * @param fn         The function handle.
+ * @param table_size The number of MSI-X vectors (1 to 2048).
+ * @param bar        The BAR index holding the table and PBA.
+ * @return The config space offset of the capability, or 0 on failure.
+ */
+uint8_t sim_add_msix(int fn, uint16_t table_size, uint8_t bar);
+
+/**
+ * @brief Adds zeroed memory that stays mapped until sim_reset(), standing in
+ * for RAM the kernel reserves and that survives a reset.
+ * @param size The size of the region in bytes.
+ * @return The simulated physical address of the region, or 0 on failure.
+ */
+uint64_t sim_add_ram(uint32_t size);
+
+/**
+ * @brief Direct access to the 256 byte configuration space of a function.
+ * @param fn The function handle.
+ * @return The configuration space, or NULL for an invalid handle.
+ */
+uint8_t *sim_config(int fn);
+
+/**
+ * @brief Returns the access counters.
+ */
+const struct sim_stats *sim_get_stats(void);
+
+/**
+ * @brief Clears the access counters only.
+ */
+void sim_reset_stats(void);
+
+#endif
@@ -0,0 +1,322 @@
+#include <io.h>
+#include <memtype.h>
+#include <pci.h>
+
+#define CPUID_EDX_MTRR (1 << 12)
+#define CPUID_EDX_PAT (1 << 16)
+#define CPUID_EXT_ADDRESS_SIZE 0x80000008
+/* Physical address width when CPUID does not report it */
+#define DEFAULT_PHYS_BITS 36
+
+#define MTRR_PAGE_MASK 0xFFFULL
+#define MTRR_MAX_VARIABLE 32
+#define MTRR_FIX64K_00000 0x250
+#define MTRR_FIX16K_80000 0x258
+#define MTRR_FIX4K_C0000 0x268
+
+/* The PAT entry switched from WT to WC; selected by PWT alone */
+#define PAT_WC_ENTRY 1
+
+static bool has_mtrr = false;
+static bool has_pat = false;
+static bool has_wc = false;
+static bool has_fixed = false;
+static uint32_t variable_count = 0;
+/* Address bits a PHYSBASE/PHYSMASK register implements */
+static uint64_t phys_mask = 0;
+
+struct mtrr_range {
+    uint64_t base;
+    uint64_t size;
+    memtype_t type;
+};
+
+bool memtype_init(void) {
+    uint32_t regs[4];
+    io_cpuid(0, regs);
+    if (regs[0] >= 1) {
+        io_cpuid(1, regs);
+        has_mtrr = regs[3] & CPUID_EDX_MTRR;
+        has_pat = regs[3] & CPUID_EDX_PAT;
+    }
+
+    uint32_t phys_bits = DEFAULT_PHYS_BITS;
+    io_cpuid(0x80000000, regs);
+    if (regs[0] >= CPUID_EXT_ADDRESS_SIZE) {
+        io_cpuid(CPUID_EXT_ADDRESS_SIZE, regs);
+        phys_bits = regs[0] & 0xFF;
+    }
+    phys_mask = ((1ULL << phys_bits) - 1) & ~MTRR_PAGE_MASK;
+
+    if (has_mtrr) {
+        uint64_t cap = io_rdmsr(MSR_MTRRCAP);
+        variable_count = cap & MTRRCAP_VCNT_MASK;
+        if (variable_count > MTRR_MAX_VARIABLE) {
+            variable_count = MTRR_MAX_VARIABLE;
+        }
+        has_fixed = cap & MTRRCAP_FIX;
+        has_wc = cap & MTRRCAP_WC;
+    }
+
+    if (has_pat) {
+        uint64_t pat = io_rdmsr(MSR_PAT);
+        uint64_t wanted = (pat & ~(0xFFULL << (PAT_WC_ENTRY * 8))) |
+                          ((uint64_t)MEMTYPE_WC << (PAT_WC_ENTRY * 8));
+        if (pat != wanted) {
+            struct io_cache_state state;
+            io_cache_disable(&state);
+            io_wrmsr(MSR_PAT, wanted);
+            io_cache_enable(&state);
+        }
+    }
+    return has_mtrr && has_wc;
+}
+
+/* Reads variable MTRR n; returns false if it is not in use */
+static bool read_variable(uint32_t n, struct mtrr_range *range) {
+    uint64_t mask = io_rdmsr(MSR_MTRR_PHYSMASK(n));
+    if (!(mask & MTRR_PHYSMASK_VALID)) return false;
+
+    uint64_t base = io_rdmsr(MSR_MTRR_PHYSBASE(n));
+    mask &= phys_mask;
+    range->base = base & mask;
+    range->size = (~mask & phys_mask) + MTRR_PAGE_MASK + 1;
+    range->type = base & MTRR_DEF_TYPE_MASK;
+    return true;
+}
+
+static bool ranges_overlap(const struct mtrr_range *range, uint64_t base,
+                           uint64_t size) {
+    return range->base < base + size && base < range->base + range->size;
+}
+
+static memtype_t fixed_type(uint64_t phys) {
+    uint32_t msr, byte;
+    if (phys < 0x80000) {
+        msr = MTRR_FIX64K_00000;
+        byte = phys >> 16;
+    } else if (phys < 0xC0000) {
+        msr = MTRR_FIX16K_80000 + ((phys - 0x80000) >> 17);
+        byte = ((phys - 0x80000) >> 14) & 0x7;
+    } else {
+        msr = MTRR_FIX4K_C0000 + ((phys - 0xC0000) >> 15);
+        byte = ((phys - 0xC0000) >> 12) & 0x7;
+    }
+    return (io_rdmsr(msr) >> (byte * 8)) & 0xFF;
+}
+
+memtype_t memtype_get(uint64_t phys) {
+    if (!has_mtrr) return MEMTYPE_UC;
+    uint64_t def = io_rdmsr(MSR_MTRR_DEF_TYPE);
+    if (!(def & MTRR_DEF_TYPE_E)) return MEMTYPE_UC;
+    if (phys < 0x100000 && has_fixed && (def & MTRR_DEF_TYPE_FE)) {
+        return fixed_type(phys);
+    }
+
+    bool matched = false;
+    memtype_t type = MEMTYPE_UC;
+    for (uint32_t n = 0; n < variable_count; n++) {
+        struct mtrr_range range;
+        if (!read_variable(n, &range) || !ranges_overlap(&range, phys, 1)) {
+            continue;
+        }
+        if (!matched) {
+            type = range.type;
+            matched = true;
+        } else if (type == MEMTYPE_UC || range.type == MEMTYPE_UC) {
+            type = MEMTYPE_UC;
+        } else if ((type == MEMTYPE_WT && range.type == MEMTYPE_WB) ||
+                   (type == MEMTYPE_WB && range.type == MEMTYPE_WT)) {
+            type = MEMTYPE_WT;
+        } else if (type != range.type) {
+            // Undefined by the architecture; assume the safe answer
+            type = MEMTYPE_UC;
+        }
+    }
+    return matched ? type : (memtype_t)(def & MTRR_DEF_TYPE_MASK);
+}
+
+/* Largest naturally aligned power-of-two block at base that fits */
+static uint64_t block_size(uint64_t base, uint64_t remaining) {
+    uint64_t size = base ? (base & (~base + 1)) : (1ULL << 63);
+    while (size > remaining) size >>= 1;
+    return size;
+}
+
+static uint64_t mtrr_update_begin(struct io_cache_state *state) {
+    uint64_t def = io_rdmsr(MSR_MTRR_DEF_TYPE);
+    io_cache_disable(state);
+    io_wrmsr(MSR_MTRR_DEF_TYPE, def & ~MTRR_DEF_TYPE_E);
+    return def;
+}
+
+static void mtrr_update_end(struct io_cache_state *state, uint64_t def) {
+    if (!(def & MTRR_DEF_TYPE_E)) {
+        // MTRRs were off, so all memory was UC: keep that as the default
+        def = (def & ~(uint64_t)(MTRR_DEF_TYPE_MASK | MTRR_DEF_TYPE_FE)) |
+              MTRR_DEF_TYPE_E | MEMTYPE_UC;
+    }
+    io_wrmsr(MSR_MTRR_DEF_TYPE, def);
+    io_cache_enable(state);
+}
+
+/* Number of variable MTRRs a range takes */
+static uint32_t count_blocks(uint64_t base, uint64_t size) {
+    uint32_t count = 0;
+    for (uint64_t at = base, left = size; left; count++) {
+        uint64_t block = block_size(at, left);
+        at += block;
+        left -= block;
+    }
+    return count;
+}
+
+/* Programs a range into the next slots; call between mtrr_update_begin()
+ * and mtrr_update_end() */
+static void write_blocks(const uint32_t *slots, uint32_t *used, uint64_t base,
+                         uint64_t size, memtype_t type) {
+    for (uint64_t at = base, left = size; left; (*used)++) {
+        uint64_t block = block_size(at, left);
+        io_wrmsr(MSR_MTRR_PHYSBASE(slots[*used]), at | type);
+        io_wrmsr(MSR_MTRR_PHYSMASK(slots[*used]),
+                 (~(block - 1) & phys_mask) | MTRR_PHYSMASK_VALID);
+        at += block;
+        left -= block;
+    }
+}
+
+bool memtype_set_range(uint64_t base, uint64_t size, memtype_t type) {
+    if (!has_mtrr || (type == MEMTYPE_WC && !has_wc)) return false;
+    if (size == 0 || ((base | size) & MTRR_PAGE_MASK) ||
+        ((base + size - 1) & ~(phys_mask | MTRR_PAGE_MASK))) {
+        return false;
+    }
+
+    // Slot 0 is kept for the UC range that has to be carved, if any
+    uint32_t slots[MTRR_MAX_VARIABLE + 1];
+    uint32_t free_count = 0;
+    bool carve = false;
+    struct mtrr_range hole = {0};
+    for (uint32_t n = 0; n < variable_count; n++) {
+        struct mtrr_range range;
+        if (!read_variable(n, &range)) {
+            slots[1 + free_count++] = n;
+            continue;
+        }
+        if (!ranges_overlap(&range, base, size)) continue;
+        if (range.type == type && range.base <= base &&
+            base + size <= range.base + range.size) {
+            return true;
+        }
+        if (type == MEMTYPE_UC) continue;
+        // UC overrides every other type, so the range has to leave a UC
+        // range that covers it (the PCI hole firmware marks UC). Partial
+        // or repeated overlaps would not give the requested type.
+        if (carve || range.type != MEMTYPE_UC || range.base > base ||
+            base + size > range.base + range.size) {
+            return false;
+        }
+        carve = true;
+        hole = range;
+        slots[0] = n;
+    }
+
+    uint64_t end = base + size;
+    uint32_t needed = count_blocks(base, size);
+    if (carve) {
+        needed += count_blocks(hole.base, base - hole.base) +
+                  count_blocks(end, hole.base + hole.size - end);
+    }
+    if (needed > free_count + carve) return false;
+
+    struct io_cache_state state;
+    uint64_t def = mtrr_update_begin(&state);
+    const uint32_t *next = carve ? slots : slots + 1;
+    uint32_t used = 0;
+    if (carve) {
+        // The hole's own slot takes the first of the pieces written here
+        write_blocks(next, &used, hole.base, base - hole.base, MEMTYPE_UC);
+        write_blocks(next, &used, end, hole.base + hole.size - end,
+                     MEMTYPE_UC);
+    }
+    write_blocks(next, &used, base, size, type);
+    mtrr_update_end(&state, def);
+    return true;
+}
+
+bool memtype_set_vga_wc(void) {
+    if (!has_mtrr || !has_wc) return false;
+
+    uint64_t def = io_rdmsr(MSR_MTRR_DEF_TYPE);
+    if (!has_fixed || !(def & MTRR_DEF_TYPE_E) ||
+        !(def & MTRR_DEF_TYPE_FE)) {
+        return memtype_set_range(VGA_BASE, MEMTYPE_VGA_TEXT_SIZE, MEMTYPE_WC);
+    }
+
+    // One byte per 16 KiB of 0xA0000 to 0xBFFFF
+    uint64_t fixed = io_rdmsr(MSR_MTRR_FIX16K_A0000);
+    uint64_t wanted = fixed;
+    for (uint32_t phys = VGA_BASE; phys < VGA_BASE + MEMTYPE_VGA_TEXT_SIZE;
+         phys += MEMTYPE_FIX16K_SIZE) {
+        uint32_t byte = (phys - MEMTYPE_VGA_WINDOW) >> 14;
+        wanted = (wanted & ~(0xFFULL << (byte * 8))) |
+                 ((uint64_t)MEMTYPE_WC << (byte * 8));
+    }
+    if (wanted != fixed) {
+        struct io_cache_state state;
+        def = mtrr_update_begin(&state);
+        io_wrmsr(MSR_MTRR_FIX16K_A0000, wanted);
+        mtrr_update_end(&state, def);
+    }
+    return true;
+}
+
+/* True if a variable range of the given type overlaps the range */
+static bool range_has_type(uint64_t base, uint64_t size, memtype_t type) {
+    for (uint32_t n = 0; n < variable_count; n++) {
+        struct mtrr_range range;
+        if (read_variable(n, &range) && range.type == type &&
+            ranges_overlap(&range, base, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+memtype_t memtype_map_bar(uint8_t bus, uint8_t device, uint8_t function,
+                          uint8_t bar) {
+    uint32_t value = getBAR(bus, device, function, bar);
+    if (value & PCI_BAR_IO_SPACE) return MEMTYPE_UC;
+
+    uint64_t base = getBARAddress(bus, device, function, bar);
+    uint64_t size = getBARSize(bus, device, function, bar);
+    if (!base || !size || !has_mtrr) return memtype_get(base);
+
+    // MTRRs work on 4 KiB pages; a smaller BAR may share its page with
+    // registers of another BAR, so it is never made write-combining
+    if ((value & PCI_BAR_PREFETCHABLE) && size >= MTRR_PAGE_MASK + 1) {
+        if (memtype_set_range(base, size, MEMTYPE_WC)) return MEMTYPE_WC;
+    } else {
+        uint64_t page = base & ~MTRR_PAGE_MASK;
+        uint64_t end = (base + size + MTRR_PAGE_MASK) & ~MTRR_PAGE_MASK;
+        if (range_has_type(page, end - page, MEMTYPE_WC)) {
+            memtype_set_range(page, end - page, MEMTYPE_UC);
+        }
+    }
+    return memtype_get(base);
+}
+
+uint32_t memtype_pte_flags(memtype_t type) {
+    // PAT index = PAT << 2 | PCD << 1 | PWT; the reset layout is
+    // WB, WT, UC-, UC, WB, WT, UC-, UC with entry 1 turned into WC
+    switch (type) {
+        case MEMTYPE_WB:
+            return 0;
+        case MEMTYPE_WC:
+            return has_pat ? PTE_PWT : (PTE_PCD | PTE_PWT);
+        case MEMTYPE_WT:
+            return has_pat ? (PTE_PAT | PTE_PWT) : PTE_PWT;
+        default:
+            return PTE_PCD | PTE_PWT;
+    }
+}
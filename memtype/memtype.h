@@ -0,0 +1,143 @@
+/**
+ * @file memtype.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Memory types for device memory. Maps the VGA text buffer, linear
+ * framebuffers and prefetchable BARs write-combining through MTRRs, so bulk
+ * writes leave the CPU as bursts instead of one uncached store each, while
+ * register BARs stay uncached. The PAT is programmed with a write-combining
+ * entry for kernels that map device memory through their own page tables.
+ * Stores to write-combining memory are weakly ordered: use the fences below
+ * before anything that depends on them having reached the device.
+ */
+#ifndef _DSP_MEMTYPE_H_
+#define _DSP_MEMTYPE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Memory type encodings shared by the MTRRs and the PAT */
+typedef enum {
+    MEMTYPE_UC = 0x00, /* Uncached */
+    MEMTYPE_WC = 0x01, /* Write-combining */
+    MEMTYPE_WT = 0x04, /* Write-through */
+    MEMTYPE_WP = 0x05, /* Write-protected */
+    MEMTYPE_WB = 0x06, /* Write-back */
+} memtype_t;
+
+/* MSRs */
+#define MSR_MTRRCAP 0xFE
+#define MSR_PAT 0x277
+#define MSR_MTRR_DEF_TYPE 0x2FF
+#define MSR_MTRR_PHYSBASE(n) (0x200 + 2 * (n))
+#define MSR_MTRR_PHYSMASK(n) (0x201 + 2 * (n))
+#define MSR_MTRR_FIX16K_A0000 0x259
+
+/* MTRRcap bits */
+#define MTRRCAP_VCNT_MASK 0xFF
+#define MTRRCAP_FIX (1 << 8)
+#define MTRRCAP_WC (1 << 10)
+/* MTRRdefType bits */
+#define MTRR_DEF_TYPE_MASK 0xFF
+#define MTRR_DEF_TYPE_FE (1 << 10)
+#define MTRR_DEF_TYPE_E (1 << 11)
+/* PHYSMASK valid bit */
+#define MTRR_PHYSMASK_VALID (1 << 11)
+
+/* PAT selector bits of a 4 KiB page table entry */
+#define PTE_PWT (1 << 3)
+#define PTE_PCD (1 << 4)
+#define PTE_PAT (1 << 7)
+
+/* The legacy VGA window is covered by the FIX16K_A0000 MTRR */
+#define MEMTYPE_VGA_WINDOW 0xA0000
+#define MEMTYPE_FIX16K_SIZE 0x4000
+/* 0xB8000 to 0xBFFFF, the text mode part of the window */
+#define MEMTYPE_VGA_TEXT_SIZE 0x8000
+
+/**
+ * @brief Orders earlier stores, including write-combining ones, before later
+ * stores. Use it between filling a write-combining buffer and the uncached
+ * register write that tells the device to use it.
+ */
+static inline void memtype_sfence(void) {
+    __asm__ volatile("sfence" : : : "memory");
+}
+
+/**
+ * @brief Orders all earlier loads and stores before later ones.
+ */
+static inline void memtype_mfence(void) {
+    __asm__ volatile("mfence" : : : "memory");
+}
+
+/**
+ * @brief Detects MTRR and PAT support and programs PAT entry 1 as
+ * write-combining (see memtype_pte_flags()). Call once before the other
+ * functions, on the boot processor.
+ * @return true if write-combining is available through the MTRRs.
+ */
+bool memtype_init(void);
+
+/**
+ * @brief Returns the memory type the MTRRs give a physical address.
+ * Overlapping variable ranges are resolved as the CPU does: UC wins, WT wins
+ * over WB.
+ * @param phys The physical address.
+ * @return The effective MTRR memory type.
+ */
+memtype_t memtype_get(uint64_t phys);
+
+/**
+ * @brief Gives a physical range a memory type using variable MTRRs.
+ * The range is split into naturally aligned power-of-two blocks, one MTRR
+ * each. Nothing is written unless enough MTRRs are free. A range inside a
+ * single UC variable range (firmware marks the PCI hole UC) is carved out of
+ * it: the UC range is split into blocks around it, which takes more MTRRs.
+ * Any other overlap with a variable range of a different type fails unless
+ * @p type is UC (UC takes precedence), because the overlap would not give
+ * the requested type.
+ * @param base The physical base address, 4 KiB aligned.
+ * @param size The size in bytes, a multiple of 4 KiB.
+ * @param type The memory type.
+ * @return true if the range now has the memory type.
+ */
+bool memtype_set_range(uint64_t base, uint64_t size, memtype_t type);
+
+/**
+ * @brief Maps the VGA text buffer (0xB8000 to 0xBFFFF) write-combining.
+ * Uses the FIX16K_A0000 fixed-range MTRR when fixed ranges are enabled, else
+ * a variable MTRR.
+ * @return true on success.
+ */
+bool memtype_set_vga_wc(void);
+
+/**
+ * @brief Picks the memory type of a BAR from its flags and programs it.
+ * Prefetchable memory BARs (framebuffers, buffers) become write-combining.
+ * Other memory BARs hold registers with side effects and are kept uncached,
+ * also when a wider write-combining range covers them. I/O BARs are left
+ * alone. A prefetchable BAR stays UC if there are not enough free MTRRs to
+ * carve it out of the UC PCI hole; map it WC through the page tables with
+ * memtype_pte_flags() then. The BAR is sized with getBARSize(), so call this before the device
+ * is in use.
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ * @param bar The BAR index (0 to 5).
+ * @return The memory type the BAR ends up with.
+ */
+memtype_t memtype_map_bar(uint8_t bus, uint8_t device, uint8_t function,
+                          uint8_t bar);
+
+/**
+ * @brief Returns the PWT/PCD/PAT bits that select a memory type in a 4 KiB
+ * page table entry, with the PAT as memtype_init() programs it. In a PTE the
+ * PAT memory type takes precedence over an uncached MTRR when it is WC.
+ * @param type The memory type.
+ * @return The page table entry bits.
+ */
+uint32_t memtype_pte_flags(memtype_t type);
+
+#endif
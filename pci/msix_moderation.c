@@ -0,0 +1,135 @@
+#include <msix_moderation.h>
+#include <pci.h>
+#include <perf.h>
+
+void msix_moderation_init(struct msix_moderation *mod,
+                          volatile uint32_t *table, volatile uint32_t *pba,
+                          uint32_t entry, msix_poll_fn poll, void *ctx,
+                          const struct msix_moderation_config *config) {
+    mod->table = table;
+    mod->pba = pba;
+    mod->entry = entry;
+    mod->poll = poll;
+    mod->ctx = ctx;
+    if (config) {
+        mod->config = *config;
+    } else {
+        mod->config = (struct msix_moderation_config){
+            .window_cycles = MSIX_MODERATION_WINDOW_CYCLES,
+            .high_rate = MSIX_MODERATION_HIGH_RATE,
+            .low_rate = MSIX_MODERATION_LOW_RATE,
+            .budget = MSIX_MODERATION_BUDGET,
+            .max_passes = MSIX_MODERATION_MAX_PASSES};
+    }
+    if (mod->config.budget == 0) mod->config.budget = 1;
+    if (mod->config.max_passes == 0) mod->config.max_passes = 1;
+
+    mod->polling = false;
+    mod->masked = false;
+    mod->scheduled = false;
+    mod->window_start = perf_rdtsc();
+    mod->window_work = 0;
+    mod->window_interrupts = 0;
+    msix_moderation_reset_stats(mod);
+    mod->stats.work_rate = 0;
+    mod->stats.interrupt_rate = 0;
+}
+
+void msix_moderation_reset_stats(struct msix_moderation *mod) {
+    uint32_t work_rate = mod->stats.work_rate;
+    uint32_t interrupt_rate = mod->stats.interrupt_rate;
+    mod->stats = (struct msix_moderation_stats){
+        .work_rate = work_rate, .interrupt_rate = interrupt_rate};
+}
+
+/* Closes the sampling window once it has run out and picks the mode for the
+ * next one. Without a divide: each further window that passed without an
+ * interrupt halves the rates. */
+static void update_rates(struct msix_moderation *mod, uint64_t now) {
+    uint64_t elapsed = now - mod->window_start;
+    uint64_t window = mod->config.window_cycles;
+    if (elapsed < window) return;
+
+    uint32_t work = mod->window_work;
+    uint32_t interrupts = mod->window_interrupts;
+    for (elapsed -= window; elapsed >= window && (work || interrupts);
+         elapsed -= window) {
+        work >>= 1;
+        interrupts >>= 1;
+    }
+    mod->stats.work_rate = work;
+    mod->stats.interrupt_rate = interrupts;
+    mod->window_start = now;
+    mod->window_work = 0;
+    mod->window_interrupts = 0;
+
+    // Hysteresis between the two thresholds keeps the mode from flapping
+    bool polling = mod->polling ? work > mod->config.low_rate
+                                : work >= mod->config.high_rate;
+    if (polling != mod->polling) {
+        mod->polling = polling;
+        mod->stats.mode_switches++;
+    }
+}
+
+/* Runs poll passes. A drained vector is unmasked; otherwise it stays masked
+ * and scheduled so that msix_moderation_poll() picks up the rest, since the
+ * device has no reason to interrupt again for work it already signalled. */
+static uint32_t service(struct msix_moderation *mod) {
+    update_rates(mod, perf_rdtsc());
+
+    uint32_t budget = mod->config.budget;
+    uint32_t total = 0;
+    uint32_t pass = 0;
+    bool drained = false;
+    while (pass < mod->config.max_passes) {
+        uint32_t done = mod->poll(mod->ctx, budget);
+        total += done;
+        pass++;
+        if (done >= budget) continue;
+        // The pending bit stays set until the vector is unmasked, so it only
+        // earns another pass while that pass still finds work
+        if (!mod->masked || done == 0 ||
+            !isMSIXPending(mod->pba, mod->entry)) {
+            drained = true;
+            break;
+        }
+        mod->stats.pending_repolls++;
+    }
+    mod->stats.poll_passes += pass;
+    mod->stats.work += total;
+    mod->window_work += total;
+
+    if (drained) {
+        mod->scheduled = false;
+        if (mod->masked) {
+            maskMSIXVector(mod->table, mod->entry, false);
+            mod->masked = false;
+        }
+    } else {
+        mod->stats.budget_exhausted++;
+        mod->scheduled = true;
+        if (!mod->masked) {
+            maskMSIXVector(mod->table, mod->entry, true);
+            mod->masked = true;
+        }
+    }
+    return total;
+}
+
+uint32_t msix_moderation_irq(struct msix_moderation *mod) {
+    mod->stats.interrupts++;
+    mod->window_interrupts++;
+    if (mod->polling) {
+        mod->stats.polled_interrupts++;
+        if (!mod->masked) {
+            maskMSIXVector(mod->table, mod->entry, true);
+            mod->masked = true;
+        }
+    }
+    return service(mod);
+}
+
+uint32_t msix_moderation_poll(struct msix_moderation *mod) {
+    return mod->scheduled ? service(mod) : 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file msix_moderation.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Adaptive interrupt moderation for MSI-X vectors. At low load every
+ * interrupt is handled as it comes. Once the work rate of a vector crosses a
+ * threshold, the vector is masked while its handler polls the device within a
+ * budget, and the Pending Bit Array is checked before it is unmasked again,
+ * so a busy queue costs one interrupt per burst instead of one per buffer.
+ */
+#ifndef _DSP_MSIX_MODERATION_H_
+#define _DSP_MSIX_MODERATION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Defaults used when msix_moderation_init() is given no configuration */
+#define MSIX_MODERATION_WINDOW_CYCLES (1ULL << 22)
+#define MSIX_MODERATION_HIGH_RATE 256
+#define MSIX_MODERATION_LOW_RATE 32
+#define MSIX_MODERATION_BUDGET 64
+#define MSIX_MODERATION_MAX_PASSES 4
+
+/**
+ * Drains up to @p budget work items (for example used virtqueue buffers) and
+ * returns how many it handled. Returning less than @p budget means the
+ * device has nothing more right now.
+ */
+typedef uint32_t (*msix_poll_fn)(void *ctx, uint32_t budget);
+
+struct msix_moderation_config {
+    /* Length of a rate sampling window in TSC cycles */
+    uint64_t window_cycles;
+    /* Work items per window at or above which the vector is polled */
+    uint32_t high_rate;
+    /* Work items per window at or below which plain interrupts resume */
+    uint32_t low_rate;
+    /* Work items per poll pass */
+    uint32_t budget;
+    /* Poll passes per interrupt before the vector is unmasked regardless */
+    uint32_t max_passes;
+};
+
+/* Counters for tuning; cumulative until msix_moderation_reset_stats() */
+struct msix_moderation_stats {
+    uint64_t interrupts;
+    /* Interrupts handled in polling mode */
+    uint64_t polled_interrupts;
+    uint64_t poll_passes;
+    uint64_t work;
+    /* Times max_passes passes did not drain the device */
+    uint64_t budget_exhausted;
+    /* Passes repeated because work and a pending message arrived while
+     * the vector was masked */
+    uint64_t pending_repolls;
+    uint64_t mode_switches;
+    /* Work items and interrupts in the last complete window */
+    uint32_t work_rate;
+    uint32_t interrupt_rate;
+};
+
+struct msix_moderation {
+    volatile uint32_t *table;
+    volatile uint32_t *pba;
+    uint32_t entry;
+    msix_poll_fn poll;
+    void *ctx;
+    struct msix_moderation_config config;
+    /* true while the vector is handled in polling mode */
+    bool polling;
+    /* true while this code holds the vector masked */
+    bool masked;
+    /* true while work is left over for msix_moderation_poll() */
+    bool scheduled;
+    uint64_t window_start;
+    uint32_t window_work;
+    uint32_t window_interrupts;
+    struct msix_moderation_stats stats;
+};
+
+/**
+ * @brief Sets up moderation for one MSI-X vector, starting in interrupt mode.
+ * @param mod    The moderation state of the vector.
+ * @param table  The MSI-X table (see getMSIXTable()).
+ * @param pba    The Pending Bit Array (see getMSIXPBA()).
+ * @param entry  The vector's table entry.
+ * @param poll   The work handler of the vector.
+ * @param ctx    Passed to @p poll.
+ * @param config The policy, or NULL for the MSIX_MODERATION_* defaults.
+ */
+void msix_moderation_init(struct msix_moderation *mod,
+                          volatile uint32_t *table, volatile uint32_t *pba,
+                          uint32_t entry, msix_poll_fn poll, void *ctx,
+                          const struct msix_moderation_config *config);
+
+/**
+ * @brief Handles an interrupt of the vector; call it from the vector's ISR.
+ * The handler runs in passes of config.budget until a pass comes back short,
+ * or at most config.max_passes times. In polling mode the vector is masked
+ * meanwhile, and a short pass only ends the loop if the PBA shows no message
+ * (or the pass found no work at all). A drained vector is unmasked; a message
+ * still pending then fires once more. If max_passes did not drain the device,
+ * the vector stays masked and is left to msix_moderation_poll().
+ * @param mod The moderation state of the vector.
+ * @return The number of work items handled.
+ */
+uint32_t msix_moderation_irq(struct msix_moderation *mod);
+
+/**
+ * @brief Continues a vector whose last interrupt ran out of budget; call it
+ * from the main or idle loop. Does nothing unless work was left over.
+ * @param mod The moderation state of the vector.
+ * @return The number of work items handled.
+ */
+uint32_t msix_moderation_poll(struct msix_moderation *mod);
+
+/**
+ * @brief Clears the counters, keeping the current mode and rates.
+ * @param mod The moderation state of the vector.
+ */
+void msix_moderation_reset_stats(struct msix_moderation *mod);
+
+#endif
@@ -1,36 +1,22 @@
+#include <io.h>
 #include <pci.h>
+#include <perf.h>
+#include <stddef.h>
 #include <vga.h>
 
-static inline void outl(uint16_t port, uint32_t value) {
-    __asm__ volatile(
-        "movw %w1, %%dx\n\t"  // Move port to DX
-        "movl %0, %%eax\n\t"  // Move value to EAX
-        "outl %%eax, %%dx"    // Output EAX to DX port
-        :
-        : "r"(value), "r"(port)
-        : "%eax", "%dx");
-}
-
-static inline uint32_t inl(uint16_t port) {
-    uint32_t value;
-    __asm__ volatile(
-        "movw %w1, %%dx\n\t"   // Move port to DX
-        "inl %%dx, %%eax\n\t"  // Input from DX port to EAX
-        "movl %%eax, %0"       // Move EAX to output variable
-        : "=r"(value)
-        : "r"(port)
-        : "%eax", "%dx");
-    return value;
-}
-
 uint32_t pci_read_config(uint32_t address) {
+    PERF_BEGIN(PERF_PCI_READ_CONFIG);
     outl(PCI_CONFIG_ADDRESS_PORT, address);
-    return inl(PCI_CONFIG_DATA_PORT);
+    uint32_t value = inl(PCI_CONFIG_DATA_PORT);
+    PERF_END(PERF_PCI_READ_CONFIG);
+    return value;
 }
 
 void pci_write_config(uint32_t address, uint32_t value) {
+    PERF_BEGIN(PERF_PCI_WRITE_CONFIG);
     outl(PCI_CONFIG_ADDRESS_PORT, address);
     outl(PCI_CONFIG_DATA_PORT, value);
+    PERF_END(PERF_PCI_WRITE_CONFIG);
 }
 
 uint16_t getVID(uint8_t bus, uint8_t device, uint8_t function) {
@@ -51,6 +37,213 @@ uint32_t getBAR0(uint8_t bus, uint8_t device, uint8_t function) {
     return pci_read_config(address);
 }
 
+uint32_t getBAR(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar) {
+    if (bar >= PCI_MAX_BARS) return 0;
+    uint32_t address =
+        PCI_CONFIG_ADDRESS(bus, device, function, PCI_BAR0_OFFSET + bar * 4);
+    return pci_read_config(address);
+}
+
+uint64_t getBARAddress(uint8_t bus, uint8_t device, uint8_t function,
+                       uint8_t bar) {
+    uint32_t low = getBAR(bus, device, function, bar);
+    if (low & PCI_BAR_IO_SPACE) {
+        return low & ~0x3u;
+    }
+
+    uint64_t base = low & ~0xFu;
+    if ((low & (0x3 << 1)) == PCI_BAR_TYPE_64 && bar + 1 < PCI_MAX_BARS) {
+        base |= (uint64_t)getBAR(bus, device, function, bar + 1) << 32;
+    }
+    return base;
+}
+
+uint64_t getBARSize(uint8_t bus, uint8_t device, uint8_t function,
+                    uint8_t bar) {
+    if (bar >= PCI_MAX_BARS) return 0;
+
+    uint32_t command_address =
+        PCI_CONFIG_ADDRESS(bus, device, function, PCI_COMMAND_OFFSET);
+    uint32_t command = pci_read_config(command_address) & 0xFFFF;
+    uint32_t address =
+        PCI_CONFIG_ADDRESS(bus, device, function, PCI_BAR0_OFFSET + bar * 4);
+    uint32_t low = pci_read_config(address);
+    bool is_64 = !(low & PCI_BAR_IO_SPACE) &&
+                 (low & (0x3 << 1)) == PCI_BAR_TYPE_64 &&
+                 bar + 1 < PCI_MAX_BARS;
+    uint32_t high = is_64 ? pci_read_config(address + 4) : 0;
+
+    // The BAR briefly decodes garbage; keep the device off the bus meanwhile
+    pci_write_config(command_address,
+                     command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+    pci_write_config(address, 0xFFFFFFFF);
+    uint64_t mask = pci_read_config(address);
+    pci_write_config(address, low);
+    if (is_64) {
+        pci_write_config(address + 4, 0xFFFFFFFF);
+        mask |= (uint64_t)pci_read_config(address + 4) << 32;
+        pci_write_config(address + 4, high);
+    } else {
+        mask |= 0xFFFFFFFF00000000ULL;
+    }
+    pci_write_config(command_address, command);
+
+    if (low & PCI_BAR_IO_SPACE) {
+        // Devices may leave the upper half of an I/O BAR unimplemented
+        mask = (mask & ~0x3ULL) | 0xFFFFFFFFFFFF0000ULL;
+    } else {
+        mask &= ~0xFULL;
+    }
+    if ((uint32_t)mask == 0 && !is_64) return 0;
+    return ~mask + 1;
+}
+
+void pci_enable_bus_master(uint8_t bus, uint8_t device, uint8_t function) {
+    uint32_t address =
+        PCI_CONFIG_ADDRESS(bus, device, function, PCI_COMMAND_OFFSET);
+    // Only touch the command half; writing 1s to status bits clears them
+    uint32_t command = pci_read_config(address) & 0xFFFF;
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER;
+    pci_write_config(address, command);
+}
+
+static uint32_t read_class_code(uint8_t bus, uint8_t device,
+                                uint8_t function) {
+    return pci_read_config(
+               PCI_CONFIG_ADDRESS(bus, device, function, PCI_CLASS_OFFSET)) >>
+           8;
+}
+
+static uint8_t read_header_type(uint8_t bus, uint8_t device,
+                                uint8_t function) {
+    return (pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function,
+                                               PCI_HEADER_TYPE_OFFSET)) >>
+            16) &
+           0xFF;
+}
+
+void pci_iter_begin(struct pci_iter *it, const struct pci_iter_filter *filter) {
+    if (filter) {
+        it->filter = *filter;
+    } else {
+        it->filter = (struct pci_iter_filter){.match = 0};
+    }
+    it->bus = 0;
+    it->device = 0;
+    it->function = 0;
+    it->functions = 1;
+}
+
+bool pci_iter_next(struct pci_iter *it, struct pci_function *fn) {
+    const struct pci_iter_filter *filter = &it->filter;
+
+    while (it->bus < PCI_MAX_BUSES) {
+        if (it->function >= it->functions) {
+            it->function = 0;
+            it->functions = 1;
+            if (++it->device == PCI_MAX_DEVICES) {
+                it->device = 0;
+                it->bus++;
+            }
+            continue;
+        }
+        uint8_t bus = it->bus, device = it->device, function = it->function++;
+
+        uint32_t ids = pci_read_config(
+            PCI_CONFIG_ADDRESS(bus, device, function, PCI_VENDOR_ID_OFFSET));
+        if ((ids & 0xFFFF) == 0xFFFF) {
+            // Without function 0 there is no device in this slot
+            if (function == 0) it->functions = 0;
+            continue;
+        }
+
+        // Function 0's header type is needed anyway to find functions 1-7
+        bool have_header = false;
+        uint8_t header_type = 0;
+        if (function == 0) {
+            header_type = read_header_type(bus, device, function);
+            have_header = true;
+            if (header_type & PCI_HEADER_TYPE_MULTIFUNCTION) {
+                it->functions = PCI_MAX_FUNCTIONS;
+            }
+        }
+
+        // Cheapest checks first: the IDs and function 0's header are in hand
+        if ((filter->match & PCI_ITER_MATCH_VENDOR) &&
+            (ids & 0xFFFF) != filter->vendor_id) {
+            continue;
+        }
+        if (filter->match & PCI_ITER_MATCH_HEADER_TYPE) {
+            if (!have_header) {
+                header_type = read_header_type(bus, device, function);
+                have_header = true;
+            }
+            if ((header_type & PCI_HEADER_TYPE_MASK) !=
+                (filter->header_type & PCI_HEADER_TYPE_MASK)) {
+                continue;
+            }
+        }
+        uint32_t class_code = read_class_code(bus, device, function);
+        if ((filter->match & PCI_ITER_MATCH_CLASS) &&
+            (class_code & filter->class_mask) !=
+                (filter->class_code & filter->class_mask)) {
+            continue;
+        }
+
+        fn->bus = bus;
+        fn->device = device;
+        fn->function = function;
+        fn->vendor_id = ids & 0xFFFF;
+        fn->device_id = ids >> 16;
+        fn->class_code = class_code;
+        fn->header_type =
+            have_header ? header_type : read_header_type(bus, device, function);
+        return true;
+    }
+    return false;
+}
+
+bool pci_find_function(const struct pci_iter_filter *filter,
+                       struct pci_function *fn) {
+    struct pci_iter it;
+    pci_iter_begin(&it, filter);
+    return pci_iter_next(&it, fn);
+}
+
+uint8_t pci_find_capability(uint8_t bus, uint8_t device, uint8_t function,
+                            uint8_t cap_id, uint8_t start) {
+    PERF_BEGIN(PERF_PCI_CAP_WALK);
+    uint8_t found = 0;
+    uint32_t cap_ptr;
+    if (start == 0) {
+        uint32_t status = pci_read_config(
+            PCI_CONFIG_ADDRESS(bus, device, function, PCI_STATUS_OFFSET));
+        cap_ptr = 0;
+        if ((status >> 16) & PCI_STATUS_CAP_LIST_BIT) {
+            cap_ptr = pci_read_config(PCI_CONFIG_ADDRESS(
+                bus, device, function, PCI_CAPABILITIES_OFFSET));
+        }
+    } else {
+        cap_ptr =
+            pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, start)) >>
+            8;
+    }
+    cap_ptr &= 0xFC;
+
+    // Bounded walk so a malformed (looping) list cannot hang the caller
+    for (int i = 0; cap_ptr && i < PCI_MAX_CAPABILITIES; i++) {
+        uint32_t header =
+            pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, cap_ptr));
+        if ((header & 0xFF) == cap_id) {
+            found = cap_ptr;
+            break;
+        }
+        cap_ptr = (header >> 8) & 0xFC;
+    }
+    PERF_END(PERF_PCI_CAP_WALK);
+    return found;
+}
+
 void writeMSIXAddress(uint8_t bus, uint8_t device, uint8_t function,
                       uint32_t cap_offset, uint32_t entry_index,
                       uint64_t address) {
@@ -73,28 +266,12 @@ void writeMSIXData(uint8_t bus, uint8_t device, uint8_t function,
 
 bool checkMSIXCapability(uint8_t bus, uint8_t device, uint8_t function,
                          uint32_t *cap_offset) {
-    uint32_t status =
-        pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, 0x06));
-    if (!(status & (1 << 4))) {
+    uint8_t cap_ptr = pci_find_capability(bus, device, function, MSIX_CAP_ID, 0);
+    if (!cap_ptr) {
         return false;
     }
-
-    uint32_t cap_ptr = pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function,
-                                                          PCI_STATUS_CAP_LIST)) &
-                       0xFF;
-    while (cap_ptr) {
-        uint32_t cap_id =
-            pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, cap_ptr)) &
-            0xFF;
-        if (cap_id == MSIX_CAP_ID) {
-            *cap_offset = cap_ptr;
-            return true;
-        }
-        cap_ptr = (pci_read_config(
-                       PCI_CONFIG_ADDRESS(bus, device, function, cap_ptr + 1)) &
-                   0xFF);
-    }
-    return false;
+    *cap_offset = cap_ptr;
+    return true;
 }
 
 void initializeMSIXMessageControl(uint8_t bus, uint8_t device, uint8_t function,
@@ -144,6 +321,69 @@ void setupMSIXPendingArrayWithDwordAccess(uint8_t bus, uint8_t device,
     }
 }
 
+uint16_t getMSIXTableSize(uint8_t bus, uint8_t device, uint8_t function,
+                          uint32_t cap_offset) {
+    uint32_t value =
+        pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, cap_offset));
+    // Message Control lives in the upper half; Table Size is N-1 encoded
+    return ((value >> 16) & 0x7FF) + 1;
+}
+
+static volatile uint32_t *msix_structure(uint8_t bus, uint8_t device,
+                                         uint8_t function, uint32_t reg) {
+    uint32_t value =
+        pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, reg));
+    uint64_t base =
+        getBARAddress(bus, device, function, value & MSIX_BIR_MASK);
+    return io_map(base + (value & ~MSIX_BIR_MASK));
+}
+
+volatile uint32_t *getMSIXTable(uint8_t bus, uint8_t device, uint8_t function,
+                                uint32_t cap_offset) {
+    return msix_structure(bus, device, function,
+                          cap_offset + PCI_MSIX_TABLE_OFFSET);
+}
+
+volatile uint32_t *getMSIXPBA(uint8_t bus, uint8_t device, uint8_t function,
+                              uint32_t cap_offset) {
+    return msix_structure(bus, device, function,
+                          cap_offset + PCI_MSIX_PBA_OFFSET);
+}
+
+void writeMSIXTableEntry(volatile uint32_t *table, uint32_t entry,
+                         uint64_t address, uint32_t data) {
+    volatile uint32_t *slot = table + entry * (MSIX_TABLE_ENTRY_SIZE / 4);
+    slot[0] = (uint32_t)(address & 0xFFFFFFFF);
+    slot[1] = (uint32_t)(address >> 32);
+    slot[2] = data;
+}
+
+void maskMSIXVector(volatile uint32_t *table, uint32_t entry, bool mask) {
+    volatile uint32_t *ctrl =
+        table + entry * (MSIX_TABLE_ENTRY_SIZE / 4) + MSIX_ENTRY_VECTOR_CTRL;
+    if (mask) {
+        *ctrl |= MSIX_ENTRY_CTRL_MASKBIT;
+    } else {
+        *ctrl &= ~MSIX_ENTRY_CTRL_MASKBIT;
+    }
+}
+
+bool isMSIXPending(volatile uint32_t *pba, uint32_t entry) {
+    return (pba[entry / 32] >> (entry % 32)) & 1;
+}
+
+void setMSIXEnable(uint8_t bus, uint8_t device, uint8_t function,
+                   uint32_t cap_offset, bool enable) {
+    uint32_t address = PCI_CONFIG_ADDRESS(bus, device, function, cap_offset);
+    uint32_t value = pci_read_config(address);
+    if (enable) {
+        value |= (uint32_t)MSIX_ENABLE << 16;
+    } else {
+        value &= ~((uint32_t)MSIX_ENABLE << 16);
+    }
+    pci_write_config(address, value);
+}
+
 void enableMSIX(uint8_t bus, uint8_t device, uint8_t function,
                 uint32_t num_vectors) {
     uint32_t msix_cap_offset;
@@ -154,6 +394,7 @@ void enableMSIX(uint8_t bus, uint8_t device, uint8_t function,
 
     print("MSI-X capability found. Initializing...");
 
+    PERF_BEGIN(PERF_MSIX_SETUP);
     uint32_t table_base = 0x80000000;  // Example base address
     uint32_t pba_base = 0x90000000;    // Example base for PBA
 
@@ -161,6 +402,7 @@ void enableMSIX(uint8_t bus, uint8_t device, uint8_t function,
                                  num_vectors);
     setupMSIXPendingArray(bus, device, function, table_base, pba_base,
                           num_vectors);
+    PERF_END(PERF_MSIX_SETUP);
 }
 
 void configureMSIXCapability(uint8_t bus, uint8_t device, uint8_t function,
@@ -173,39 +415,29 @@ void configureMSIXCapability(uint8_t bus, uint8_t device, uint8_t function,
 }
 
 void pci_enumerate() {
+    PERF_BEGIN(PERF_PCI_ENUMERATE);
     print_colored("Enumerating PCI Devices...", COLOR_WHITE, COLOR_BLACK);
     newline();
 
-    for (uint32_t bus = 0; bus < PCI_MAX_BUSES; bus++) {
-        for (uint32_t device = 0; device < PCI_MAX_DEVICES; device++) {
-            for (uint32_t function = 0; function < PCI_MAX_FUNCTIONS;
-                 function++) {
-                uint32_t address = PCI_CONFIG_ADDRESS(bus, device, function,
-                                                      PCI_VENDOR_ID_OFFSET);
-                uint32_t data = pci_read_config(address);
-                uint16_t vendor_id = data & 0xFFFF;
-
-                if (vendor_id != 0xFFFF) {  // Valid device
-                    uint16_t device_id = (data >> 16) & 0xFFFF;
-
-                    print_colored("Found PCI Device: Bus ", COLOR_WHITE,
-                                  COLOR_BLACK);
-                    newline();
-                    print_i(bus);
-                    print_colored(" Device ", COLOR_WHITE, COLOR_BLACK);
-                    print_i(device);
-                    print_colored(" Function ", COLOR_WHITE, COLOR_BLACK);
-                    print_i(function);
-                    newline();
-                    print_colored(" - Vendor ID: 0x", COLOR_GREEN, COLOR_BLACK);
-                    print_hex(vendor_id);
-                    print_colored(" Device ID: 0x", COLOR_YELLOW, COLOR_BLACK);
-                    print_hex(device_id);
-                    newline();
-                }
-            }
-        }
+    struct pci_iter it;
+    struct pci_function fn;
+    pci_iter_begin(&it, NULL);
+    while (pci_iter_next(&it, &fn)) {
+        print_colored("Found PCI Device: Bus ", COLOR_WHITE, COLOR_BLACK);
+        newline();
+        print_i(fn.bus);
+        print_colored(" Device ", COLOR_WHITE, COLOR_BLACK);
+        print_i(fn.device);
+        print_colored(" Function ", COLOR_WHITE, COLOR_BLACK);
+        print_i(fn.function);
+        newline();
+        print_colored(" - Vendor ID: 0x", COLOR_GREEN, COLOR_BLACK);
+        print_hex(fn.vendor_id);
+        print_colored(" Device ID: 0x", COLOR_YELLOW, COLOR_BLACK);
+        print_hex(fn.device_id);
+        newline();
     }
+    PERF_END(PERF_PCI_ENUMERATE);
 }
 
 void print_pci_capabilities(uint8_t bus, uint8_t device, uint8_t function) {
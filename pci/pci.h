@@ -1,5 +1,6 @@
 #ifndef _DSP_PCI_H_
 #define _DSP_PCI_H_
+#include <io.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <vga.h>
@@ -8,9 +9,29 @@
 
 #define PCI_VENDOR_ID_OFFSET 0x00
 #define PCI_DEVICE_ID_OFFSET 0x02
+#define PCI_COMMAND_OFFSET 0x04
 #define PCI_STATUS_OFFSET 0x04
+#define PCI_CLASS_OFFSET 0x08
+#define PCI_HEADER_TYPE_OFFSET 0x0E
 #define PCI_BAR0_OFFSET 0x10
 #define PCI_CAPABILITIES_OFFSET 0x34
+#define PCI_MAX_BARS 6
+
+/* Command register bits */
+#define PCI_COMMAND_IO (1 << 0)
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+/* Status register bit (in the upper 16 bits of the dword at 0x04) */
+#define PCI_STATUS_CAP_LIST_BIT (1 << 4)
+
+/* Header Type register */
+#define PCI_HEADER_TYPE_MASK 0x7F
+#define PCI_HEADER_TYPE_MULTIFUNCTION 0x80
+
+/* BAR decoding */
+#define PCI_BAR_IO_SPACE (1 << 0)
+#define PCI_BAR_TYPE_64 (0x2 << 1)
+#define PCI_BAR_PREFETCHABLE (1 << 3)
 
 #define PCI_MSIX_CAP_OFFSET 0x70
 #define MSIX_CAP_ID 0x11
@@ -22,6 +43,17 @@
 #define MSIX_FUNCTION_MASK (1 << 14)
 /* Size of each MSI-X table entry */
 #define MSIX_TABLE_ENTRY_SIZE 16
+/* Table/PBA offset registers hold the BAR index (BIR) in bits 2:0 */
+#define MSIX_BIR_MASK 0x7
+/* Vector Control word of an MSI-X table entry */
+#define MSIX_ENTRY_VECTOR_CTRL 3
+#define MSIX_ENTRY_CTRL_MASKBIT (1 << 0)
+/* x86 MSI message address: 0xFEE00000 | destination APIC ID << 12 */
+#define MSI_ADDRESS_BASE 0xFEE00000
+#define MSI_ADDRESS(apic_id) (MSI_ADDRESS_BASE | ((uint32_t)(apic_id) << 12))
+
+/* Longest legal capability chain in the 256 byte config space */
+#define PCI_MAX_CAPABILITIES 48
 
 #define PCI_MAX_BUSES 256
 #define PCI_MAX_DEVICES 32
@@ -31,25 +63,37 @@
     (0x80000000 | ((bus) << 16) | ((dev) << 11) | ((func) << 8) | \
      ((offset) & 0xFC))
 
+/* Identity of a discovered PCI function */
+struct pci_function {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t header_type;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    /* Class, subclass and prog-if as 0xCCSSPP */
+    uint32_t class_code;
+};
+
 /**
  * @brief Writes a 32-bit value to an I/O port.
- * This function uses inline assembly to write a 32-bit value to a specified
- * I/O port, which is typical for interacting with hardware registers in
- * bare-metal systems.
+ * This function writes a 32-bit value to a specified I/O port through the
+ * backend in io.h: inline assembly on hardware, or the simulated machine when
+ * built with DSP_HOST_SIM.
  * @param port The I/O port address to write to.
  * @param value The 32-bit value to write to the port.
  */
-static inline void outl(uint16_t port, uint32_t value);
+static inline void outl(uint16_t port, uint32_t value) { io_outl(port, value); }
 
 /**
  * @brief Reads a 32-bit value from an I/O port.
- * This function uses inline assembly to read a 32-bit value from a specified
- * I/O port, which is essential for reading values from hardware registers in
- * bare-metal systems.
+ * This function reads a 32-bit value from a specified I/O port through the
+ * backend in io.h: inline assembly on hardware, or the simulated machine when
+ * built with DSP_HOST_SIM.
  * @param port The I/O port address to read from.
  * @return The 32-bit value read from the port.
  */
-static inline uint32_t inl(uint16_t port);
+static inline uint32_t inl(uint16_t port) { return io_inl(port); }
 
 /**
  * @brief Reads from the PCI configuration space.
@@ -107,6 +151,130 @@ uint16_t getDID(uint8_t bus, uint8_t device, uint8_t function);
  */
 uint32_t getBAR0(uint8_t bus, uint8_t device, uint8_t function);
 
+/**
+ * @brief Reads the raw value of any Base Address Register of a PCI device.
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ * @param bar The BAR index (0 to 5).
+ * @return The 32-bit value of the BAR, or 0 for an out of range index.
+ */
+uint32_t getBAR(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar);
+
+/**
+ * @brief Decodes the base address held in a BAR.
+ * Memory BARs have their flag bits masked off and 64-bit BARs are combined
+ * with the following register. I/O BARs return the port base.
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ * @param bar The BAR index (0 to 5).
+ * @return The decoded base address of the BAR.
+ */
+uint64_t getBARAddress(uint8_t bus, uint8_t device, uint8_t function,
+                       uint8_t bar);
+
+/**
+ * @brief Sizes a BAR by writing all ones to it and reading back which address
+ * bits the device implements. Decoding is disabled in the Command register
+ * while the BAR holds all ones, and the BAR and Command register are restored
+ * afterwards.
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ * @param bar The BAR index (0 to 5).
+ * @return The size of the region in bytes, or 0 for an unimplemented BAR.
+ */
+uint64_t getBARSize(uint8_t bus, uint8_t device, uint8_t function,
+                    uint8_t bar);
+
+/* Fields of a pci_iter_filter that are compared */
+#define PCI_ITER_MATCH_VENDOR (1 << 0)
+#define PCI_ITER_MATCH_CLASS (1 << 1)
+#define PCI_ITER_MATCH_HEADER_TYPE (1 << 2)
+
+/* Class code of an AHCI SATA controller, with its mask */
+#define PCI_CLASS_AHCI 0x010601
+#define PCI_CLASS_MASK_FULL 0xFFFFFF
+
+/* Selects the functions a pci_iter yields */
+struct pci_iter_filter {
+    /* PCI_ITER_MATCH_* bits; 0 yields every function */
+    uint32_t match;
+    uint16_t vendor_id;
+    /* Compared under class_mask; class_code bits outside it are ignored */
+    uint32_t class_code;
+    uint32_t class_mask;
+    /* Compared without the multi-function bit */
+    uint8_t header_type;
+};
+
+/* Scan position of a bus walk; see pci_iter_begin() */
+struct pci_iter {
+    struct pci_iter_filter filter;
+    uint16_t bus;
+    uint8_t device;
+    uint8_t function;
+    /* Functions to visit on the current device (1 or 8) */
+    uint8_t functions;
+};
+
+/**
+ * @brief Starts a walk over the PCI functions that match a filter.
+ * Nothing is read until pci_iter_next() is called.
+ * @param it The iterator.
+ * @param filter The functions to yield, or NULL for all of them.
+ */
+void pci_iter_begin(struct pci_iter *it, const struct pci_iter_filter *filter);
+
+/**
+ * @brief Yields the next function that matches the iterator's filter.
+ * Functions are visited in bus/device/function order, and functions 1 to 7
+ * only on multi-function devices. Each function costs one config read for
+ * its IDs; the class and header type are read only when a filter needs them
+ * or the function is yielded, and a failing check skips the remaining reads.
+ * The walk may be abandoned at any point.
+ * @param it The iterator.
+ * @param fn Receives the identity of the function.
+ * @return false once the walk is complete.
+ */
+bool pci_iter_next(struct pci_iter *it, struct pci_function *fn);
+
+/**
+ * @brief Finds the first function that matches a filter, stopping the scan
+ * there.
+ * @param filter The function to look for.
+ * @param fn Receives its identity.
+ * @return false if no function matches.
+ */
+bool pci_find_function(const struct pci_iter_filter *filter,
+                       struct pci_function *fn);
+
+/**
+ * @brief Enables memory space decoding and bus mastering for a device.
+ * Required before a device may be driven through its memory BARs or perform
+ * DMA (for example virtqueues).
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ */
+void pci_enable_bus_master(uint8_t bus, uint8_t device, uint8_t function);
+
+/**
+ * @brief Walks the capability list of a device looking for a capability ID.
+ * Passing the offset of a previous match as @p start continues the walk after
+ * it, which allows iterating over repeated capabilities such as the
+ * vendor-specific (0x09) structures of virtio devices.
+ * @param bus The bus number of the PCI device.
+ * @param device The device number on the bus.
+ * @param function The function number of the device.
+ * @param cap_id The capability ID to look for.
+ * @param start 0 to start at the list head, else a previous match.
+ * @return The config space offset of the capability, or 0 if not found.
+ */
+uint8_t pci_find_capability(uint8_t bus, uint8_t device, uint8_t function,
+                            uint8_t cap_id, uint8_t start);
+
 /**
  * @brief Writes to the MSI-X Message Table Address.
  * This function writes the specified address to the MSI-X Message Table entry
@@ -222,6 +390,79 @@ void configureMSIXCapability(uint8_t bus, uint8_t device, uint8_t function,
                              uint32_t cap_offset, uint64_t tableOffset,
                              uint64_t pbaOffset);
 
+/**
+ * @brief Returns the number of entries in the MSI-X table of a device.
+ * @param bus        The bus number where the PCI device is located.
+ * @param device     The device number of the PCI device.
+ * @param function   The function number of the PCI device.
+ * @param cap_offset The offset of the MSI-X capability.
+ * @return The table size (1 to 2048).
+ */
+uint16_t getMSIXTableSize(uint8_t bus, uint8_t device, uint8_t function,
+                          uint32_t cap_offset);
+
+/**
+ * @brief Locates the memory mapped MSI-X table of a device.
+ * Decodes the Table Offset/BIR register and resolves it against the BAR it
+ * points into.
+ * @param bus        The bus number where the PCI device is located.
+ * @param device     The device number of the PCI device.
+ * @param function   The function number of the PCI device.
+ * @param cap_offset The offset of the MSI-X capability.
+ * @return Pointer to the first dword of the MSI-X table.
+ */
+volatile uint32_t *getMSIXTable(uint8_t bus, uint8_t device, uint8_t function,
+                                uint32_t cap_offset);
+
+/**
+ * @brief Locates the memory mapped MSI-X Pending Bit Array of a device.
+ * @param bus        The bus number where the PCI device is located.
+ * @param device     The device number of the PCI device.
+ * @param function   The function number of the PCI device.
+ * @param cap_offset The offset of the MSI-X capability.
+ * @return Pointer to the first dword of the Pending Bit Array.
+ */
+volatile uint32_t *getMSIXPBA(uint8_t bus, uint8_t device, uint8_t function,
+                              uint32_t cap_offset);
+
+/**
+ * @brief Programs the message address and data of a memory mapped MSI-X
+ * table entry. The entry's mask bit is left untouched.
+ * @param table   The MSI-X table as returned by getMSIXTable.
+ * @param entry   The index of the table entry.
+ * @param address The 64-bit message address (see MSI_ADDRESS).
+ * @param data    The message data, the IDT vector on x86.
+ */
+void writeMSIXTableEntry(volatile uint32_t *table, uint32_t entry,
+                         uint64_t address, uint32_t data);
+
+/**
+ * @brief Masks or unmasks a single MSI-X vector.
+ * @param table The MSI-X table as returned by getMSIXTable.
+ * @param entry The index of the table entry.
+ * @param mask  true to mask the vector, false to unmask it.
+ */
+void maskMSIXVector(volatile uint32_t *table, uint32_t entry, bool mask);
+
+/**
+ * @brief Checks the Pending Bit of an MSI-X vector.
+ * @param pba   The Pending Bit Array as returned by getMSIXPBA.
+ * @param entry The index of the vector.
+ * @return true if a message is pending for the (masked) vector.
+ */
+bool isMSIXPending(volatile uint32_t *pba, uint32_t entry);
+
+/**
+ * @brief Sets or clears the MSI-X Enable bit of the Message Control register.
+ * @param bus        The bus number where the PCI device is located.
+ * @param device     The device number of the PCI device.
+ * @param function   The function number of the PCI device.
+ * @param cap_offset The offset of the MSI-X capability.
+ * @param enable     true to enable MSI-X, false to disable it.
+ */
+void setMSIXEnable(uint8_t bus, uint8_t device, uint8_t function,
+                   uint32_t cap_offset, bool enable);
+
 /**
  * @brief Enables MSI-X for the specified PCI device and initializes the
  * MSI-X Table and Pending Bit Array. This function checks for the MSI-X
@@ -238,9 +479,8 @@ void enableMSIX(uint8_t bus, uint8_t device, uint8_t function,
 
 /**
  * @brief Enumerates all PCI devices on the system.
- * This function scans all PCI buses, devices, and functions, and prints
- * information about any valid PCI devices it finds, such as the Vendor ID,
- * Device ID, and the bus/device/function numbers.
+ * Walks the bus with pci_iter_next() and prints the bus/device/function
+ * numbers, Vendor ID and Device ID of every function it finds.
  */
 void pci_enumerate();
 
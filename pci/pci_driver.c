@@ -0,0 +1,187 @@
+#include <pci_driver.h>
+#include <stddef.h>
+
+/* Bounds of the pci_drivers section, provided by the linker. Weak so that a
+ * kernel without any registered driver still links. */
+extern const struct pci_driver __start_pci_drivers[] __attribute__((weak));
+extern const struct pci_driver __stop_pci_drivers[] __attribute__((weak));
+
+/* Key of class entries that do not pin the base class */
+#define CLASS_KEY_ANY 0x100
+
+struct pci_match {
+    /* ID entries: vendor << 16 | device, device is PCI_ANY_ID for
+     * vendor-wide entries. Class entries: the base class, or CLASS_KEY_ANY. */
+    uint32_t key;
+    /* Registration order, to keep the sort deterministic */
+    uint16_t order;
+    const struct pci_driver *driver;
+    const struct pci_device_id *id;
+};
+
+/* Entries with a vendor, sorted by vendor and device; entries without one
+ * (class drivers), sorted by base class */
+static struct pci_match id_matches[PCI_DRIVER_MAX_IDS];
+static uint32_t id_match_count = 0;
+static struct pci_match class_matches[PCI_DRIVER_MAX_IDS];
+static uint32_t class_match_count = 0;
+static uint32_t dropped_ids = 0;
+static bool match_table_built = false;
+
+static bool match_less(const struct pci_match *a, const struct pci_match *b) {
+    return a->key < b->key || (a->key == b->key && a->order < b->order);
+}
+
+static void sift_down(struct pci_match *matches, uint32_t root,
+                      uint32_t count) {
+    for (;;) {
+        uint32_t child = 2 * root + 1;
+        if (child >= count) return;
+        if (child + 1 < count &&
+            match_less(&matches[child], &matches[child + 1])) {
+            child++;
+        }
+        if (!match_less(&matches[root], &matches[child])) return;
+        struct pci_match tmp = matches[root];
+        matches[root] = matches[child];
+        matches[child] = tmp;
+        root = child;
+    }
+}
+
+/* Heapsort: O(n log n) without recursion or extra memory */
+static void sort_matches(struct pci_match *matches, uint32_t count) {
+    for (uint32_t i = count / 2; i-- > 0;) {
+        sift_down(matches, i, count);
+    }
+    for (uint32_t end = count; end-- > 1;) {
+        struct pci_match tmp = matches[0];
+        matches[0] = matches[end];
+        matches[end] = tmp;
+        sift_down(matches, 0, end);
+    }
+}
+
+static uint32_t class_key(const struct pci_device_id *id) {
+    return (id->class_mask & 0xFF0000) == 0xFF0000
+               ? (id->class_code >> 16) & 0xFF
+               : CLASS_KEY_ANY;
+}
+
+static void build_match_table(void) {
+    uint16_t order = 0;
+
+    for (const struct pci_driver *driver = __start_pci_drivers;
+         driver && driver < __stop_pci_drivers; driver++) {
+        for (const struct pci_device_id *id = driver->id_table;
+             id && id->vendor; id++, order++) {
+            struct pci_match match = {
+                .key = ((uint32_t)id->vendor << 16) | id->device,
+                .order = order,
+                .driver = driver,
+                .id = id};
+            if (id->vendor == PCI_ANY_ID) {
+                match.key = class_key(id);
+                if (class_match_count < PCI_DRIVER_MAX_IDS)
+                    class_matches[class_match_count++] = match;
+                else
+                    dropped_ids++;
+            } else {
+                if (id_match_count < PCI_DRIVER_MAX_IDS)
+                    id_matches[id_match_count++] = match;
+                else
+                    dropped_ids++;
+            }
+        }
+    }
+
+    sort_matches(id_matches, id_match_count);
+    sort_matches(class_matches, class_match_count);
+    match_table_built = true;
+}
+
+uint32_t pci_driver_dropped_ids(void) {
+    if (!match_table_built) {
+        build_match_table();
+    }
+    return dropped_ids;
+}
+
+static bool id_matches_function(const struct pci_device_id *id,
+                                const struct pci_function *fn) {
+    return (id->vendor == PCI_ANY_ID || id->vendor == fn->vendor_id) &&
+           (id->device == PCI_ANY_ID || id->device == fn->device_id) &&
+           (fn->class_code & id->class_mask) ==
+               (id->class_code & id->class_mask);
+}
+
+/* First entry with the given key that also matches the function, or NULL.
+ * Entries with equal keys are in registration order. */
+static const struct pci_match *find_key(const struct pci_match *matches,
+                                        uint32_t count, uint32_t key,
+                                        const struct pci_function *fn) {
+    uint32_t low = 0;
+    uint32_t high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (matches[mid].key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (; low < count && matches[low].key == key; low++) {
+        if (id_matches_function(matches[low].id, fn)) {
+            return &matches[low];
+        }
+    }
+    return NULL;
+}
+
+const struct pci_driver *pci_match_driver(const struct pci_function *fn,
+                                          const struct pci_device_id **id) {
+    if (!match_table_built) {
+        build_match_table();
+    }
+
+    const struct pci_match *match =
+        find_key(id_matches, id_match_count,
+                 ((uint32_t)fn->vendor_id << 16) | fn->device_id, fn);
+    if (!match) {
+        match = find_key(id_matches, id_match_count,
+                         ((uint32_t)fn->vendor_id << 16) | PCI_ANY_ID, fn);
+    }
+    if (!match) {
+        // Only the function's base class bucket and the entries that leave
+        // the base class open are searched; the earlier registration wins
+        const struct pci_match *by_class =
+            find_key(class_matches, class_match_count,
+                     (fn->class_code >> 16) & 0xFF, fn);
+        const struct pci_match *any_class = find_key(
+            class_matches, class_match_count, CLASS_KEY_ANY, fn);
+        match = by_class;
+        if (!match || (any_class && any_class->order < match->order)) {
+            match = any_class;
+        }
+    }
+
+    if (!match) return NULL;
+    if (id) *id = match->id;
+    return match->driver;
+}
+
+bool pci_probe_function(const struct pci_function *fn) {
+    const struct pci_device_id *id;
+    const struct pci_driver *driver = pci_match_driver(fn, &id);
+    return driver && driver->probe && driver->probe(fn, id);
+}
+
+uint32_t pci_probe_drivers(void) {
+    uint32_t bound = 0;
+    struct pci_iter it;
+    struct pci_function fn;
+    pci_iter_begin(&it, NULL);
+    while (pci_iter_next(&it, &fn)) {
+        if (pci_probe_function(&fn)) bound++;
+    }
+    return bound;
+}
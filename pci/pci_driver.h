@@ -0,0 +1,105 @@
+/**
+ * @file pci_driver.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Compile-time PCI driver registration. Drivers declare a const
+ * match table and probe function with PCI_DRIVER; the declarations are
+ * collected into the pci_drivers linker section, and pci_probe_drivers()
+ * dispatches every discovered function to its driver in a single bus scan.
+ */
+#ifndef _DSP_PCI_DRIVER_H_
+#define _DSP_PCI_DRIVER_H_
+
+#include <pci.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Matches any vendor or device ID */
+#define PCI_ANY_ID 0xFFFF
+
+/* Upper bound on match entries across all registered drivers */
+#define PCI_DRIVER_MAX_IDS 256
+
+/* One match entry. A zero vendor terminates a table. */
+struct pci_device_id {
+    uint16_t vendor;
+    uint16_t device;
+    /* The entry matches if (fn->class_code & class_mask) ==
+     * (class_code & class_mask) */
+    uint32_t class_code;
+    uint32_t class_mask;
+};
+
+#define PCI_DEVICE(vendor_id, device_id) \
+    {.vendor = (vendor_id), .device = (device_id)}
+#define PCI_DEVICE_CLASS(class, mask) \
+    {.vendor = PCI_ANY_ID, .device = PCI_ANY_ID, .class_code = (class), \
+     .class_mask = (mask)}
+
+struct pci_driver {
+    const char *name;
+    const struct pci_device_id *id_table;
+    /* Returns true if the driver took the function */
+    bool (*probe)(const struct pci_function *fn,
+                  const struct pci_device_id *id);
+};
+
+/**
+ * Declares a driver in the pci_drivers section:
+ *
+ *     PCI_DRIVER(virtio_blk) = {
+ *         .name = "virtio-blk",
+ *         .id_table = virtio_blk_ids,
+ *         .probe = virtio_blk_probe,
+ *     };
+ *
+ * Kernels with their own linker script must keep the section and define its
+ * bounds:
+ *
+ *     pci_drivers : {
+ *         __start_pci_drivers = .;
+ *         KEEP(*(pci_drivers))
+ *         __stop_pci_drivers = .;
+ *     }
+ */
+#define PCI_DRIVER(ident)                                              \
+    static const struct pci_driver ident##_pci_driver                  \
+        __attribute__((used, section("pci_drivers"),                   \
+                       aligned(__alignof__(struct pci_driver))))
+
+/**
+ * @brief Looks up the driver for a function.
+ * The registered match tables are collected and sorted on first use; exact
+ * vendor/device entries are found by binary search, then vendor-wide
+ * entries, then class entries in the function's base class bucket.
+ * @param fn The function to match.
+ * @param id If non-NULL, receives the matching entry.
+ * @return The matching driver, or NULL.
+ */
+const struct pci_driver *pci_match_driver(const struct pci_function *fn,
+                                          const struct pci_device_id **id);
+
+/**
+ * @brief Returns the number of match entries that did not fit the lookup
+ * tables. Their drivers are never matched by those entries; a nonzero
+ * result means PCI_DRIVER_MAX_IDS has to be raised.
+ * @return The number of ignored match entries.
+ */
+uint32_t pci_driver_dropped_ids(void);
+
+/**
+ * @brief Hands a function to its driver, if one is registered.
+ * @param fn The function to probe.
+ * @return true if a driver took the function.
+ */
+bool pci_probe_function(const struct pci_function *fn);
+
+/**
+ * @brief Scans all buses once and probes the matching driver of every
+ * function found.
+ * @return The number of functions a driver took.
+ */
+uint32_t pci_probe_drivers(void);
+
+#endif
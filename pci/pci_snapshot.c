@@ -0,0 +1,276 @@
+#include <io.h>
+#include <pci_driver.h>
+#include <pci_snapshot.h>
+#include <stddef.h>
+#include <vga.h>
+
+#define FNV_OFFSET_BASIS 0x811C9DC5
+#define FNV_PRIME 0x01000193
+
+static uint32_t fnv1a(uint32_t hash, const void *data, uint32_t len) {
+    const uint8_t *bytes = data;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t snapshot_checksum(const struct pci_snapshot *snap) {
+    uint32_t hash = fnv1a(FNV_OFFSET_BASIS, &snap->count, sizeof(snap->count));
+    return fnv1a(hash, snap->entries,
+                 (uint32_t)snap->count * sizeof(struct pci_snapshot_entry));
+}
+
+static uint32_t entry_key(uint8_t bus, uint8_t device, uint8_t function) {
+    return ((uint32_t)bus << 8) | (device << 3) | function;
+}
+
+static uint32_t entry_bars(const struct pci_function *fn) {
+    switch (fn->header_type & PCI_HEADER_TYPE_MASK) {
+        case 0x00:
+            return PCI_MAX_BARS;
+        case 0x01:  // PCI-to-PCI bridge
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static void capture_function(const struct pci_function *fn,
+                             struct pci_snapshot_entry *entry) {
+    uint8_t bus = fn->bus, device = fn->device, function = fn->function;
+    uint8_t *raw = (uint8_t *)entry;
+    for (uint32_t i = 0; i < sizeof(*entry); i++) raw[i] = 0;
+
+    entry->fn = *fn;
+    for (uint32_t bar = 0; bar < entry_bars(fn); bar++) {
+        entry->bars[bar] = getBAR(bus, device, function, bar);
+    }
+
+    uint32_t status = pci_read_config(
+        PCI_CONFIG_ADDRESS(bus, device, function, PCI_STATUS_OFFSET));
+    if (!((status >> 16) & PCI_STATUS_CAP_LIST_BIT)) return;
+
+    // Single walk of the chain, bounded like pci_find_capability()
+    uint32_t cap_ptr = pci_read_config(PCI_CONFIG_ADDRESS(
+                           bus, device, function, PCI_CAPABILITIES_OFFSET)) &
+                       0xFC;
+    for (int i = 0; cap_ptr && i < PCI_MAX_CAPABILITIES; i++) {
+        uint32_t header =
+            pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, cap_ptr));
+        uint8_t id = header & 0xFF;
+        if (entry->cap_count < PCI_SNAPSHOT_MAX_CAPS) {
+            entry->caps[entry->cap_count++] =
+                (struct pci_snapshot_cap){.id = id, .offset = cap_ptr};
+        }
+        if (id == MSIX_CAP_ID && !entry->msix_cap) {
+            entry->msix_cap = cap_ptr;
+            entry->msix_table_size = ((header >> 16) & 0x7FF) + 1;
+            entry->msix_table = pci_read_config(PCI_CONFIG_ADDRESS(
+                bus, device, function, cap_ptr + PCI_MSIX_TABLE_OFFSET));
+            entry->msix_pba = pci_read_config(PCI_CONFIG_ADDRESS(
+                bus, device, function, cap_ptr + PCI_MSIX_PBA_OFFSET));
+        }
+        cap_ptr = (header >> 8) & 0xFC;
+    }
+}
+
+uint32_t pci_snapshot_capture(struct pci_snapshot *snap, uint32_t size) {
+    if (size < sizeof(*snap)) return 0;
+    uint32_t capacity =
+        (size - sizeof(*snap)) / sizeof(struct pci_snapshot_entry);
+    uint32_t count = 0;
+
+    struct pci_iter it;
+    struct pci_function fn;
+    pci_iter_begin(&it, NULL);
+    while (pci_iter_next(&it, &fn)) {
+        if (count >= capacity || count >= 0xFFFF) return 0;
+        capture_function(&fn, &snap->entries[count++]);
+    }
+
+    snap->magic = PCI_SNAPSHOT_MAGIC;
+    snap->version = PCI_SNAPSHOT_VERSION;
+    snap->count = count;
+    snap->reserved = 0;
+    snap->checksum = snapshot_checksum(snap);
+    return PCI_SNAPSHOT_SIZE(count);
+}
+
+bool pci_snapshot_check(const struct pci_snapshot *snap, uint32_t size) {
+    if (size < sizeof(*snap) || snap->magic != PCI_SNAPSHOT_MAGIC ||
+        snap->version != PCI_SNAPSHOT_VERSION) {
+        return false;
+    }
+    if (PCI_SNAPSHOT_SIZE(snap->count) > size) return false;
+    return snap->checksum == snapshot_checksum(snap);
+}
+
+/* True if every slot of @p bus outside the @p present mask is still empty */
+static bool empty_slots_unchanged(uint8_t bus, uint32_t present) {
+    for (uint8_t device = 0; device < PCI_MAX_DEVICES; device++) {
+        if (present & (1u << device)) continue;
+        uint32_t ids = pci_read_config(
+            PCI_CONFIG_ADDRESS(bus, device, 0, PCI_VENDOR_ID_OFFSET));
+        if ((ids & 0xFFFF) != 0xFFFF) return false;
+    }
+    return true;
+}
+
+bool pci_snapshot_validate(const struct pci_snapshot *snap) {
+    // Bus 0 is always checked, even by an empty snapshot
+    uint8_t bus = 0;
+    uint32_t present = 0;
+    for (uint32_t i = 0; i < snap->count; i++) {
+        const struct pci_snapshot_entry *entry = &snap->entries[i];
+        const struct pci_function *fn = &entry->fn;
+
+        // Entries are sorted, so a bus is finished when the next one starts
+        if (fn->bus != bus) {
+            if (!empty_slots_unchanged(bus, present)) return false;
+            bus = fn->bus;
+            present = 0;
+        }
+        present |= 1u << fn->device;
+
+        uint32_t ids = pci_read_config(PCI_CONFIG_ADDRESS(
+            fn->bus, fn->device, fn->function, PCI_VENDOR_ID_OFFSET));
+        if (ids != (((uint32_t)fn->device_id << 16) | fn->vendor_id)) {
+            return false;
+        }
+        // Catches firmware that assigned the resources differently
+        if (entry_bars(fn) &&
+            getBAR0(fn->bus, fn->device, fn->function) != entry->bars[0]) {
+            return false;
+        }
+    }
+    return empty_slots_unchanged(bus, present);
+}
+
+struct pci_snapshot *pci_snapshot_boot(uint64_t phys, uint32_t size,
+                                       bool *warm) {
+    struct pci_snapshot *snap = io_map(phys);
+    bool reused = pci_snapshot_check(snap, size) && pci_snapshot_validate(snap);
+
+    if (warm) *warm = reused;
+    if (reused) return snap;
+    if (!pci_snapshot_capture(snap, size)) {
+        // Do not leave a partial snapshot for the next boot
+        snap->magic = 0;
+        return NULL;
+    }
+    return snap;
+}
+
+const struct pci_snapshot_entry *pci_snapshot_find(
+    const struct pci_snapshot *snap, uint8_t bus, uint8_t device,
+    uint8_t function) {
+    uint32_t key = entry_key(bus, device, function);
+    uint32_t low = 0;
+    uint32_t high = snap->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const struct pci_function *fn = &snap->entries[mid].fn;
+        uint32_t mid_key = entry_key(fn->bus, fn->device, fn->function);
+        if (mid_key == key) return &snap->entries[mid];
+        if (mid_key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+static bool entries_equal(const struct pci_snapshot_entry *a,
+                          const struct pci_snapshot_entry *b) {
+    const uint8_t *x = (const uint8_t *)a;
+    const uint8_t *y = (const uint8_t *)b;
+    for (uint32_t i = 0; i < sizeof(*a); i++) {
+        if (x[i] != y[i]) return false;
+    }
+    return true;
+}
+
+static void print_diff(pci_snapshot_change_t change,
+                       const struct pci_snapshot_entry *old_entry,
+                       const struct pci_snapshot_entry *new_entry,
+                       void *ctx) {
+    (void)ctx;
+    const struct pci_function *fn = new_entry ? &new_entry->fn : &old_entry->fn;
+    switch (change) {
+        case PCI_SNAPSHOT_ADDED:
+            print_colored("+ ", COLOR_GREEN, COLOR_BLACK);
+            break;
+        case PCI_SNAPSHOT_REMOVED:
+            print_colored("- ", COLOR_RED, COLOR_BLACK);
+            break;
+        default:
+            print_colored("~ ", COLOR_YELLOW, COLOR_BLACK);
+            break;
+    }
+    print_i(fn->bus);
+    print(":");
+    print_i(fn->device);
+    print(".");
+    print_i(fn->function);
+    print(" 0x");
+    print_hex(fn->vendor_id);
+    print(":0x");
+    print_hex(fn->device_id);
+    if (change == PCI_SNAPSHOT_CHANGED &&
+        (old_entry->fn.vendor_id != fn->vendor_id ||
+         old_entry->fn.device_id != fn->device_id)) {
+        print(" was 0x");
+        print_hex(old_entry->fn.vendor_id);
+        print(":0x");
+        print_hex(old_entry->fn.device_id);
+    }
+    newline();
+}
+
+uint32_t pci_snapshot_diff(const struct pci_snapshot *old_snap,
+                           const struct pci_snapshot *new_snap,
+                           pci_snapshot_diff_fn fn, void *ctx) {
+    if (!fn) fn = print_diff;
+
+    // Both snapshots are sorted by BDF, so a single merge pass finds all
+    // differences
+    uint32_t differences = 0;
+    uint32_t i = 0, j = 0;
+    while (i < old_snap->count || j < new_snap->count) {
+        const struct pci_snapshot_entry *a =
+            i < old_snap->count ? &old_snap->entries[i] : NULL;
+        const struct pci_snapshot_entry *b =
+            j < new_snap->count ? &new_snap->entries[j] : NULL;
+        uint32_t key_a =
+            a ? entry_key(a->fn.bus, a->fn.device, a->fn.function) : ~0u;
+        uint32_t key_b =
+            b ? entry_key(b->fn.bus, b->fn.device, b->fn.function) : ~0u;
+
+        if (key_a < key_b) {
+            fn(PCI_SNAPSHOT_REMOVED, a, NULL, ctx);
+            differences++;
+            i++;
+        } else if (key_b < key_a) {
+            fn(PCI_SNAPSHOT_ADDED, NULL, b, ctx);
+            differences++;
+            j++;
+        } else {
+            if (!entries_equal(a, b)) {
+                fn(PCI_SNAPSHOT_CHANGED, a, b, ctx);
+                differences++;
+            }
+            i++;
+            j++;
+        }
+    }
+    return differences;
+}
+
+uint32_t pci_snapshot_probe_drivers(const struct pci_snapshot *snap) {
+    uint32_t bound = 0;
+    for (uint32_t i = 0; i < snap->count; i++) {
+        if (pci_probe_function(&snap->entries[i].fn)) bound++;
+    }
+    return bound;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file pci_snapshot.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Config-space snapshots for fast warm boot. A snapshot records the
+ * discovered topology (BDFs, IDs, BARs, capability offsets and MSI-X layout)
+ * in a compact, versioned binary format. Kept in memory that survives a
+ * reset, it is validated on the next boot with a couple of config reads per
+ * function instead of a full scan of every bus.
+ */
+#ifndef _DSP_PCI_SNAPSHOT_H_
+#define _DSP_PCI_SNAPSHOT_H_
+
+#include <pci.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* "PCIS" in memory */
+#define PCI_SNAPSHOT_MAGIC 0x53494350
+/* Bumped whenever the layout of the structures below changes */
+#define PCI_SNAPSHOT_VERSION 1
+/* Capabilities recorded per function; longer chains are truncated */
+#define PCI_SNAPSHOT_MAX_CAPS 8
+
+struct pci_snapshot_cap {
+    uint8_t id;
+    uint8_t offset;
+};
+
+/* One function. Unused fields are zero so entries compare with memcmp. */
+struct pci_snapshot_entry {
+    struct pci_function fn;
+    /* Raw BAR registers; bridges only have BARs 0 and 1 */
+    uint32_t bars[PCI_MAX_BARS];
+    /* Offset of the MSI-X capability, 0 without MSI-X */
+    uint8_t msix_cap;
+    uint8_t cap_count;
+    uint16_t msix_table_size;
+    /* Raw Table Offset/BIR and PBA Offset/BIR registers */
+    uint32_t msix_table;
+    uint32_t msix_pba;
+    struct pci_snapshot_cap caps[PCI_SNAPSHOT_MAX_CAPS];
+};
+
+struct pci_snapshot {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    /* FNV-1a over count and the entries */
+    uint32_t checksum;
+    uint32_t reserved;
+    /* Sorted by bus, device, function */
+    struct pci_snapshot_entry entries[];
+};
+
+/* Bytes needed for a snapshot of @p count functions */
+#define PCI_SNAPSHOT_SIZE(count)    \
+    (sizeof(struct pci_snapshot) + \
+     (uint32_t)(count) * sizeof(struct pci_snapshot_entry))
+
+typedef enum {
+    PCI_SNAPSHOT_ADDED,
+    PCI_SNAPSHOT_REMOVED,
+    PCI_SNAPSHOT_CHANGED,
+} pci_snapshot_change_t;
+
+/* Diff callback; the entry that does not exist for a change is NULL */
+typedef void (*pci_snapshot_diff_fn)(pci_snapshot_change_t change,
+                                     const struct pci_snapshot_entry *old_entry,
+                                     const struct pci_snapshot_entry *new_entry,
+                                     void *ctx);
+
+/**
+ * @brief Scans all buses and records every function found.
+ * @param snap The buffer to write the snapshot to.
+ * @param size The size of the buffer in bytes.
+ * @return The size of the snapshot in bytes, or 0 if it does not fit.
+ */
+uint32_t pci_snapshot_capture(struct pci_snapshot *snap, uint32_t size);
+
+/**
+ * @brief Checks the format of a snapshot: magic, version, size and checksum.
+ * Does not touch the hardware.
+ * @param snap The snapshot.
+ * @param size The size of the buffer holding it in bytes.
+ * @return true if the snapshot is well formed.
+ */
+bool pci_snapshot_check(const struct pci_snapshot *snap, uint32_t size);
+
+/**
+ * @brief Checks a snapshot against the hardware.
+ * Reads the IDs and the first BAR of every recorded function, and the Vendor
+ * ID of every empty slot on the recorded buses, stopping at the first
+ * mismatch. A device added in an empty slot is detected this way; a function
+ * added to a recorded device or a device on a new bus behind an unchanged
+ * bridge is not, and needs a full capture and pci_snapshot_diff().
+ * @param snap A snapshot that passed pci_snapshot_check().
+ * @return true if every recorded function is still present and unchanged.
+ */
+bool pci_snapshot_validate(const struct pci_snapshot *snap);
+
+/**
+ * @brief Warm boot entry point.
+ * Maps a memory region that is preserved across resets (for example RAM
+ * reserved by the kernel, which QEMU keeps on system_reset). If it holds a
+ * snapshot that passes pci_snapshot_check() and pci_snapshot_validate(), it
+ * is used as is; otherwise the buses are scanned and a new snapshot is
+ * written to the region.
+ * @param phys The physical address of the region.
+ * @param size The size of the region in bytes.
+ * @param warm If non-NULL, set to true when the stored snapshot was reused.
+ * @return The snapshot, or NULL if the topology does not fit in the region.
+ */
+struct pci_snapshot *pci_snapshot_boot(uint64_t phys, uint32_t size,
+                                       bool *warm);
+
+/**
+ * @brief Looks up a function in a snapshot by binary search.
+ * @return The entry, or NULL if the snapshot does not have the function.
+ */
+const struct pci_snapshot_entry *pci_snapshot_find(
+    const struct pci_snapshot *snap, uint8_t bus, uint8_t device,
+    uint8_t function);
+
+/**
+ * @brief Compares two snapshots function by function.
+ * @param old_snap The earlier snapshot.
+ * @param new_snap The later snapshot.
+ * @param fn Called for every added, removed or changed function; NULL
+ * prints the differences on VGA.
+ * @param ctx Passed to @p fn.
+ * @return The number of differences.
+ */
+uint32_t pci_snapshot_diff(const struct pci_snapshot *old_snap,
+                           const struct pci_snapshot *new_snap,
+                           pci_snapshot_diff_fn fn, void *ctx);
+
+/**
+ * @brief Hands every function of a snapshot to its registered driver, without
+ * scanning the buses (see pci_driver.h).
+ * @return The number of functions a driver took.
+ */
+uint32_t pci_snapshot_probe_drivers(const struct pci_snapshot *snap);
+
+#endif
@@ -0,0 +1,155 @@
+#include <perf.h>
+
+#ifdef DSP_PERF
+
+#include <io.h>
+#include <stdbool.h>
+#include <vga.h>
+
+/* Line Status Register of the UART and its "transmit holding empty" bit */
+#define PERF_SERIAL_LSR (PERF_SERIAL_PORT + 5)
+#define PERF_SERIAL_THRE (1 << 5)
+
+static struct perf_stat perf_stats[PERF_EVENT_COUNT];
+static bool perf_paused = false;
+
+static const char *const perf_event_names[PERF_EVENT_COUNT] = {
+    [PERF_PCI_READ_CONFIG] = "pci_read_config",
+    [PERF_PCI_WRITE_CONFIG] = "pci_write_config",
+    [PERF_PCI_ENUMERATE] = "pci_enumerate",
+    [PERF_PCI_CAP_WALK] = "pci_find_capability",
+    [PERF_MSIX_SETUP] = "msix_setup",
+    [PERF_VIRTQ_KICK] = "virtq_kick",
+    [PERF_VGA_CHAR] = "vga_char",
+    [PERF_VGA_RUN] = "vga_run",
+    [PERF_VGA_SCROLL] = "vga_scroll",
+    [PERF_VGA_CLEAR] = "vga_clear",
+    [PERF_VGA_FLUSH] = "vga_flush",
+};
+
+void perf_record(perf_event_t event, uint64_t cycles) {
+    if (perf_paused || event >= PERF_EVENT_COUNT) return;
+
+    struct perf_stat *stat = &perf_stats[event];
+    if (stat->calls == 0 || cycles < stat->min_cycles) {
+        stat->min_cycles = cycles;
+    }
+    if (cycles > stat->max_cycles) {
+        stat->max_cycles = cycles;
+    }
+    stat->calls++;
+    stat->total_cycles += cycles;
+
+    // floor(log2(cycles)), with 0 and 1 cycles sharing bucket 0
+    uint32_t bucket = cycles > 1 ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= PERF_HIST_BUCKETS) bucket = PERF_HIST_BUCKETS - 1;
+    stat->hist[bucket]++;
+}
+
+const struct perf_stat *perf_get(perf_event_t event) {
+    if (event >= PERF_EVENT_COUNT) return 0;
+    return &perf_stats[event];
+}
+
+void perf_reset(void) {
+    uint8_t *bytes = (uint8_t *)perf_stats;
+    for (uint32_t i = 0; i < sizeof(perf_stats); i++) {
+        bytes[i] = 0;
+    }
+}
+
+static void perf_puts(perf_sink_t sink, const char *s) {
+    if (sink == PERF_SINK_VGA) {
+        print(s);
+        return;
+    }
+    for (; *s; s++) {
+        if (sink == PERF_SINK_SERIAL) {
+            while (!(io_inb(PERF_SERIAL_LSR) & PERF_SERIAL_THRE)) {
+            }
+            io_outb(PERF_SERIAL_PORT, *s);
+        } else {
+            io_outb(PERF_DEBUGCON_PORT, *s);
+        }
+    }
+}
+
+/* 64-bit decimal conversion by repeated subtraction, so 32-bit builds do not
+ * need libgcc's 64-bit division helpers */
+static void perf_putu64(perf_sink_t sink, uint64_t value) {
+    static const uint64_t powers[] = {
+        10000000000000000000ULL, 1000000000000000000ULL,
+        100000000000000000ULL,   10000000000000000ULL,
+        1000000000000000ULL,     100000000000000ULL,
+        10000000000000ULL,       1000000000000ULL,
+        100000000000ULL,         10000000000ULL,
+        1000000000ULL,           100000000ULL,
+        10000000ULL,             1000000ULL,
+        100000ULL,               10000ULL,
+        1000ULL,                 100ULL,
+        10ULL,                   1ULL};
+    char buffer[21];
+    char *ptr = buffer;
+
+    for (uint32_t i = 0; i < sizeof(powers) / sizeof(powers[0]); i++) {
+        char digit = '0';
+        while (value >= powers[i]) {
+            value -= powers[i];
+            digit++;
+        }
+        // Skip leading zeros but always print the last digit
+        if (digit != '0' || ptr != buffer || powers[i] == 1) {
+            *ptr++ = digit;
+        }
+    }
+    *ptr = '\0';
+    perf_puts(sink, buffer);
+}
+
+/* Shift-subtract division for the average, for the same reason as above */
+static uint64_t perf_div(uint64_t dividend, uint32_t divisor) {
+    uint64_t quotient = 0;
+    uint64_t remainder = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        remainder = (remainder << 1) | ((dividend >> bit) & 1);
+        if (remainder >= divisor) {
+            remainder -= divisor;
+            quotient |= 1ULL << bit;
+        }
+    }
+    return quotient;
+}
+
+void perf_dump(perf_sink_t sink) {
+    perf_paused = true;
+    perf_puts(sink, "perf: calls / min / avg / max cycles\n");
+
+    for (int event = 0; event < PERF_EVENT_COUNT; event++) {
+        const struct perf_stat *stat = &perf_stats[event];
+        if (stat->calls == 0) continue;
+
+        perf_puts(sink, perf_event_names[event]);
+        perf_puts(sink, ": ");
+        perf_putu64(sink, stat->calls);
+        perf_puts(sink, " / ");
+        perf_putu64(sink, stat->min_cycles);
+        perf_puts(sink, " / ");
+        perf_putu64(sink, perf_div(stat->total_cycles, stat->calls));
+        perf_puts(sink, " / ");
+        perf_putu64(sink, stat->max_cycles);
+        perf_puts(sink, "\n ");
+
+        // Only the populated buckets, as "2^n:count"
+        for (int bucket = 0; bucket < PERF_HIST_BUCKETS; bucket++) {
+            if (!stat->hist[bucket]) continue;
+            perf_puts(sink, " 2^");
+            perf_putu64(sink, bucket);
+            perf_puts(sink, ":");
+            perf_putu64(sink, stat->hist[bucket]);
+        }
+        perf_puts(sink, "\n");
+    }
+    perf_paused = false;
+}
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file perf.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Opt-in hot-path instrumentation for the PCI, VGA and virtio
+ * libraries. Build every library file with -DDSP_PERF to keep per-API call
+ * counters and rdtsc cycle histograms (log2 buckets). Without DSP_PERF the
+ * PERF_* macros and the dump/reset functions compile to nothing.
+ */
+#ifndef _DSP_PERF_H_
+#define _DSP_PERF_H_
+
+#include <stdint.h>
+
+/* The instrumented APIs */
+typedef enum {
+    PERF_PCI_READ_CONFIG = 0,
+    PERF_PCI_WRITE_CONFIG,
+    PERF_PCI_ENUMERATE,
+    PERF_PCI_CAP_WALK,
+    PERF_MSIX_SETUP,
+    PERF_VIRTQ_KICK,
+    PERF_VGA_CHAR,
+    PERF_VGA_RUN,
+    PERF_VGA_SCROLL,
+    PERF_VGA_CLEAR,
+    PERF_VGA_FLUSH,
+    PERF_EVENT_COUNT
+} perf_event_t;
+
+/* Where perf_dump writes its report */
+typedef enum {
+    PERF_SINK_VGA = 0,
+    PERF_SINK_SERIAL,   /* COM1, 0x3F8 */
+    PERF_SINK_DEBUGCON, /* QEMU -debugcon, port 0xE9 */
+} perf_sink_t;
+
+#define PERF_SERIAL_PORT 0x3F8
+#define PERF_DEBUGCON_PORT 0xE9
+
+/* Bucket n holds samples of 2^n to 2^(n+1)-1 cycles */
+#define PERF_HIST_BUCKETS 32
+
+struct perf_stat {
+    uint32_t calls;
+    uint64_t total_cycles;
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint32_t hist[PERF_HIST_BUCKETS];
+};
+
+/**
+ * @brief Reads the time stamp counter.
+ * The lfence keeps earlier instructions from being counted after the read.
+ * Available whether or not DSP_PERF is defined.
+ * @return The current TSC value.
+ */
+static inline uint64_t perf_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi)::"memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#ifdef DSP_PERF
+
+/**
+ * @brief Adds one sample to the statistics of an event.
+ * @param event  The instrumented API.
+ * @param cycles The cycles the call took.
+ */
+void perf_record(perf_event_t event, uint64_t cycles);
+
+/**
+ * @brief Returns the statistics collected for an event.
+ * @param event The instrumented API.
+ * @return Pointer into the static statistics table.
+ */
+const struct perf_stat *perf_get(perf_event_t event);
+
+/**
+ * @brief Clears all counters and histograms.
+ */
+void perf_reset(void);
+
+/**
+ * @brief Prints counters, cycle summaries and histograms of every event
+ * that was hit. Recording is paused while dumping so the dump does not
+ * count its own VGA writes.
+ * @param sink Where to print the report.
+ */
+void perf_dump(perf_sink_t sink);
+
+/* Time the code between PERF_BEGIN and PERF_END (same scope) */
+#define PERF_BEGIN(event) uint64_t perf_start_##event = perf_rdtsc()
+#define PERF_END(event) perf_record(event, perf_rdtsc() - perf_start_##event)
+
+#else
+
+#define PERF_BEGIN(event)
+#define PERF_END(event)
+
+static inline const struct perf_stat *perf_get(perf_event_t event) {
+    (void)event;
+    return 0;
+}
+static inline void perf_reset(void) {}
+static inline void perf_dump(perf_sink_t sink) { (void)sink; }
+
+#endif
+
+#endif
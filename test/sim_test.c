@@ -0,0 +1,958 @@
+/**
+ * @file sim_test.c
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details Host checks on the simulated machine (see io/sim.h): access counts
+ * of the PCI paths and the behaviour of code that needs a device to react.
+ * Build and run with `make check`.
+ */
+#include <memtype.h>
+#include <msix_moderation.h>
+#include <pci.h>
+#include <pci_driver.h>
+#include <pci_snapshot.h>
+#include <perf.h>
+#include <sim.h>
+#include <stddef.h>
+#include <vga.h>
+#include <virtio.h>
+
+/* stdio.h is left out: its putc clashes with the one in vga.h */
+int printf(const char *format, ...);
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+#define CHECK_EQ(actual, expected) \
+    check_eq((actual), (expected), #actual, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+    if (!ok) {
+        printf("sim_test.c:%d: check failed: %s\n", line, what);
+        failures++;
+    }
+}
+
+static void check_eq(uint64_t actual, uint64_t expected, const char *what,
+                     int line) {
+    if (actual != expected) {
+        printf("sim_test.c:%d: %s is %llu, expected %llu\n", line, what,
+               (unsigned long long)actual, (unsigned long long)expected);
+        failures++;
+    }
+}
+
+static bool same(const char *a, const char *b) {
+    while (*a && *a == *b) a++, b++;
+    return *a == *b;
+}
+
+/* Row y of the simulated screen without trailing blanks */
+static const char *screen_row(int y) {
+    static char row[COLS + 1];
+    int end = 0;
+    for (int x = 0; x < COLS; x++) {
+        row[x] = sim_vga_buffer[y * COLS + x] & 0xFF;
+        if (row[x] != ' ') end = x + 1;
+    }
+    row[end] = '\0';
+    return row;
+}
+
+/* Host bridge, a bridge to bus 1 and a virtio-blk function behind it */
+static int small_topology(void) {
+    sim_reset();
+    sim_add_function(0, 0, 0, 0x8086, 0x29C0, 0x060000);
+    sim_add_bridge(0, 1, 0, 1, 1);
+    return sim_add_function(1, 0, 0, 0x1AF4, 0x1042, 0x010000);
+}
+
+static void test_enumerate_reads(void) {
+    small_topology();
+    clear();
+    sim_reset_stats();
+    pci_enumerate();
+    // One ID read per bus/device slot, plus the header type and class code
+    // of each of the three functions
+    CHECK_EQ(sim_get_stats()->config_reads,
+             PCI_MAX_BUSES * PCI_MAX_DEVICES + 3 * 2);
+    CHECK_EQ(sim_get_stats()->config_writes, 0);
+
+    // Three lines per function, with the IDs in green and yellow
+    CHECK(same(screen_row(0), "Enumerating PCI Devices..."));
+    CHECK(same(screen_row(1), "Found PCI Device: Bus"));
+    CHECK(same(screen_row(3),
+               " - Vendor ID: 0x00008086 Device ID: 0x000029C0"));
+    CHECK_EQ(sim_vga_buffer[3 * COLS + 1], (COLOR_GREEN << 8) | '-');
+    CHECK_EQ(sim_vga_buffer[3 * COLS + 25], (COLOR_YELLOW << 8) | 'D');
+    CHECK(same(screen_row(9),
+               " - Vendor ID: 0x00001AF4 Device ID: 0x00001042"));
+}
+
+/* PIIX on bus 0, virtio-net, an AHCI controller and a bridge to buses 1-2
+ * with a virtio-blk function on bus 2 */
+static void storage_topology(void) {
+    sim_reset();
+    sim_add_function(0, 0, 0, 0x8086, 0x1237, 0x060000);
+    sim_add_function(0, 1, 0, 0x8086, 0x7000, 0x060100);
+    sim_add_function(0, 1, 1, 0x8086, 0x7010, 0x010180);
+    sim_add_function(0, 3, 0, 0x1AF4, 0x1041, 0x020000);
+    sim_add_function(0, 4, 0, 0x8086, 0x2922, PCI_CLASS_AHCI);
+    sim_add_bridge(0, 5, 0, 1, 2);
+    sim_add_function(2, 0, 0, 0x1AF4, 0x1042, 0x010000);
+}
+
+/* The functions the filter yields, as bus << 8 | device << 3 | function */
+static uint32_t iter_collect(const struct pci_iter_filter *filter,
+                             uint16_t *found, uint32_t max) {
+    struct pci_iter it;
+    struct pci_function fn;
+    uint32_t count = 0;
+    pci_iter_begin(&it, filter);
+    while (pci_iter_next(&it, &fn)) {
+        if (count < max)
+            found[count] = fn.bus << 8 | fn.device << 3 | fn.function;
+        count++;
+    }
+    return count;
+}
+
+static void test_iter_filters(void) {
+    storage_topology();
+    uint16_t found[8];
+
+    // Up to 0:4.0: IDs for every slot and for 0:1.1-7, the header type of
+    // each function 0, and the class code of each function present
+    struct pci_iter_filter ahci = {.match = PCI_ITER_MATCH_CLASS,
+                                   .class_code = PCI_CLASS_AHCI,
+                                   .class_mask = PCI_CLASS_MASK_FULL};
+    struct pci_function fn;
+    sim_reset_stats();
+    CHECK(pci_find_function(&ahci, &fn));
+    CHECK_EQ(fn.bus << 8 | fn.device << 3 | fn.function, 4 << 3);
+    CHECK_EQ(fn.header_type, 0);
+    CHECK_EQ(sim_get_stats()->config_reads, 21);
+
+    // The full walk: one ID read per slot and per function 1-7 of 0:1, plus
+    // the header type and class code of the seven functions
+    sim_reset_stats();
+    CHECK_EQ(iter_collect(NULL, found, 8), 7);
+    CHECK_EQ(sim_get_stats()->config_reads,
+             PCI_MAX_BUSES * PCI_MAX_DEVICES + 7 + 7 * 2);
+    CHECK_EQ(sim_get_stats()->config_reads, 8213);
+
+    // Bits of class_code outside class_mask are ignored: any mass storage
+    struct pci_iter_filter storage = {.match = PCI_ITER_MATCH_CLASS,
+                                      .class_code = PCI_CLASS_AHCI,
+                                      .class_mask = 0xFF0000};
+    CHECK_EQ(iter_collect(&storage, found, 8), 3);
+    CHECK_EQ(found[0], 1 << 3 | 1);
+    CHECK_EQ(found[1], 4 << 3);
+    CHECK_EQ(found[2], 2 << 8);
+
+    struct pci_iter_filter virtio = {.match = PCI_ITER_MATCH_VENDOR,
+                                     .vendor_id = 0x1AF4};
+    CHECK_EQ(iter_collect(&virtio, found, 8), 2);
+    CHECK_EQ(found[0], 3 << 3);
+    CHECK_EQ(found[1], 2 << 8);
+
+    struct pci_iter_filter bridges = {.match = PCI_ITER_MATCH_HEADER_TYPE,
+                                      .header_type = 0x01};
+    CHECK_EQ(iter_collect(&bridges, found, 8), 1);
+    CHECK_EQ(found[0], 5 << 3);
+    // The multi-function bit of 0:1.0 does not stop it matching type 0
+    struct pci_iter_filter intel_type0 = {
+        .match = PCI_ITER_MATCH_VENDOR | PCI_ITER_MATCH_HEADER_TYPE,
+        .vendor_id = 0x8086,
+        .header_type = 0x00};
+    CHECK_EQ(iter_collect(&intel_type0, found, 8), 4);
+    CHECK_EQ(found[1], 1 << 3);
+}
+
+static void test_msix_placement(void) {
+    int blk = small_topology();
+    uint8_t cap = sim_add_msix(blk, 8, 1);
+    CHECK(cap != 0);
+    CHECK_EQ(pci_find_capability(1, 0, 0, MSIX_CAP_ID, 0), cap);
+    CHECK_EQ(getMSIXTableSize(1, 0, 0, cap), 8);
+
+    volatile uint32_t *table = getMSIXTable(1, 0, 0, cap);
+    volatile uint32_t *pba = getMSIXPBA(1, 0, 0, cap);
+    CHECK(table[7 * 4 + MSIX_ENTRY_VECTOR_CTRL] & MSIX_ENTRY_CTRL_MASKBIT);
+    CHECK_EQ((uintptr_t)pba - (uintptr_t)table, 8 * MSIX_TABLE_ENTRY_SIZE);
+
+    // A 4 KiB BAR cannot hold 2048 vectors (32 KiB of table)
+    int small = sim_add_function(0, 2, 0, 0x1AF4, 0x1041, 0x020000);
+    CHECK(sim_add_bar(small, 0, 4096, false) != 0);
+    CHECK_EQ(sim_add_msix(small, 2048, 0), 0);
+    CHECK(sim_add_msix(small, 64, 0) != 0);
+}
+
+/* A device queue for test_msix_moderation(): polls drain the backlog, and
+ * the first poll after arm_pending is set delivers that much more work with
+ * a message, which the PBA latches while the vector is masked. */
+struct fake_queue {
+    volatile uint32_t *table;
+    volatile uint32_t *pba;
+    uint32_t backlog;
+    uint32_t arm_pending;
+};
+
+static bool vector_masked(volatile uint32_t *table) {
+    return table[MSIX_ENTRY_VECTOR_CTRL] & MSIX_ENTRY_CTRL_MASKBIT;
+}
+
+static uint32_t fake_poll(void *ctx, uint32_t budget) {
+    struct fake_queue *q = ctx;
+    uint32_t done = q->backlog < budget ? q->backlog : budget;
+    q->backlog -= done;
+    if (q->arm_pending) {
+        q->backlog += q->arm_pending;
+        q->arm_pending = 0;
+        if (vector_masked(q->table)) q->pba[0] |= 1;
+    }
+    return done;
+}
+
+/* Ends the sampling window without waiting for it: the next interrupt sees
+ * exactly one window elapsed, so the rates are not halved */
+static void close_window(struct msix_moderation *mod) {
+    mod->window_start = perf_rdtsc() - mod->config.window_cycles;
+}
+
+static void test_msix_moderation(void) {
+    int blk = small_topology();
+    uint8_t cap = sim_add_msix(blk, 4, 1);
+    struct fake_queue q = {.table = getMSIXTable(1, 0, 0, cap),
+                           .pba = getMSIXPBA(1, 0, 0, cap)};
+    maskMSIXVector(q.table, 0, false);
+
+    // The window only ends through close_window()
+    const struct msix_moderation_config config = {.window_cycles = 1ULL << 40,
+                                                  .high_rate = 16,
+                                                  .low_rate = 2,
+                                                  .budget = 8,
+                                                  .max_passes = 4};
+    struct msix_moderation mod;
+    msix_moderation_init(&mod, q.table, q.pba, 0, fake_poll, &q, &config);
+
+    // Interrupt mode: light work is handled without masking
+    q.backlog = 5;
+    CHECK_EQ(msix_moderation_irq(&mod), 5);
+    CHECK(!vector_masked(q.table));
+    CHECK_EQ(mod.stats.poll_passes, 1);
+
+    // Four full passes do not drain 40 items: the vector stays masked until
+    // msix_moderation_poll() finishes the rest
+    q.backlog = 40;
+    CHECK_EQ(msix_moderation_irq(&mod), 32);
+    CHECK_EQ(mod.stats.budget_exhausted, 1);
+    CHECK(vector_masked(q.table));
+    CHECK_EQ(msix_moderation_poll(&mod), 8);
+    CHECK(!vector_masked(q.table));
+    CHECK_EQ(msix_moderation_poll(&mod), 0);
+    CHECK_EQ(mod.stats.mode_switches, 0);
+
+    // 45 items in the window: the interrupt that closes it switches the
+    // vector to polling for the ones after it
+    close_window(&mod);
+    CHECK_EQ(msix_moderation_irq(&mod), 0);
+    CHECK(mod.polling);
+    CHECK_EQ(mod.stats.mode_switches, 1);
+    CHECK_EQ(mod.stats.work_rate, 45);
+    CHECK_EQ(mod.stats.polled_interrupts, 0);
+
+    // A message that arrives during a short pass while masked earns a
+    // re-poll. Both short passes found work with the pending bit set; the
+    // third came back empty and unmasked the vector.
+    q.backlog = 3;
+    q.arm_pending = 2;
+    CHECK_EQ(msix_moderation_irq(&mod), 5);
+    CHECK_EQ(mod.stats.polled_interrupts, 1);
+    CHECK_EQ(mod.stats.pending_repolls, 2);
+    CHECK(!vector_masked(q.table));
+    CHECK(isMSIXPending(q.pba, 0));
+    q.pba[0] = 0;
+
+    // 5 items stay above low_rate; an idle window returns to interrupts
+    close_window(&mod);
+    CHECK_EQ(msix_moderation_irq(&mod), 0);
+    CHECK(mod.polling);
+    close_window(&mod);
+    CHECK_EQ(msix_moderation_irq(&mod), 0);
+    CHECK(!mod.polling);
+    CHECK_EQ(mod.stats.mode_switches, 2);
+    CHECK_EQ(mod.stats.polled_interrupts, 3);
+    CHECK_EQ(mod.stats.interrupts, 6);
+    CHECK_EQ(mod.stats.work, 50);
+}
+
+/* A modern virtio-blk function at 0:3.0. BAR 4 holds the common
+ * configuration at 0x0000, the ISR at 0x1000, the device configuration at
+ * 0x2000 and the notify region at 0x3000. The regions are plain memory, so
+ * both feature selects read the same word and queue_size is shared by all
+ * queues. */
+#define VIRTIO_TEST_ISR 0x1000
+#define VIRTIO_TEST_DEVICE 0x2000
+#define VIRTIO_TEST_NOTIFY 0x3000
+#define VIRTIO_TEST_NOTIFY_MULT 4
+#define VIRTIO_TEST_QUEUE 1
+
+static void add_virtio_cap(int fn, uint8_t cfg_type, uint8_t bar,
+                           uint32_t offset, uint32_t length) {
+    // virtio_pci_cap from cap_len on, plus notify_off_multiplier
+    uint8_t body[18] = {cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG ? 20 : 16,
+                        cfg_type, bar};
+    for (int i = 0; i < 4; i++) {
+        body[6 + i] = offset >> (8 * i);
+        body[10 + i] = length >> (8 * i);
+        body[14 + i] = VIRTIO_TEST_NOTIFY_MULT >> (8 * i);
+    }
+    sim_add_capability(fn, VIRTIO_PCI_CAP_ID, body,
+                       cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG ? 18 : 14);
+}
+
+static uint8_t *virtio_topology(void) {
+    sim_reset();
+    int blk = sim_add_function(0, 3, 0, VIRTIO_PCI_VENDOR_ID, 0x1042, 0x010000);
+    uint8_t *regions = io_map(sim_add_bar(blk, 4, 0x4000, false));
+    sim_add_msix(blk, 4, 1);
+    // Not a region the driver maps; must be skipped
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_PCI_CFG, 0, 0, 4);
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_COMMON_CFG, 4, 0,
+                   sizeof(struct virtio_pci_common_cfg));
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_NOTIFY_CFG, 4, VIRTIO_TEST_NOTIFY,
+                   0x1000);
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_ISR_CFG, 4, VIRTIO_TEST_ISR, 1);
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_DEVICE_CFG, 4, VIRTIO_TEST_DEVICE, 60);
+    // A second common configuration; the first one wins
+    add_virtio_cap(blk, VIRTIO_PCI_CAP_COMMON_CFG, 4, 0x800,
+                   sizeof(struct virtio_pci_common_cfg));
+
+    struct virtio_pci_common_cfg *common = (void *)regions;
+    common->num_queues = 2;
+    common->queue_size = 256;
+    return regions;
+}
+
+/* Resets the simulated device and negotiates VERSION_1, EVENT_IDX and,
+ * if asked for, RING_PACKED (bits 29, 32 and 34) */
+static bool virtio_start(struct virtio_device *vdev, uint8_t *regions,
+                         bool packed) {
+    struct virtio_pci_common_cfg *common = (void *)regions;
+    if (!virtio_pci_init(vdev, 0, 3, 0)) return false;
+    common->device_feature = (1u << 29) | (1u << 0) | (1u << 2);
+    uint64_t wanted = VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX) |
+                      (packed ? VIRTIO_FEATURE(VIRTIO_F_RING_PACKED) : 0);
+    return virtio_negotiate_features(vdev, wanted);
+}
+
+static void *queue_address(uint32_t lo, uint32_t hi) {
+    return (void *)(uintptr_t)((uint64_t)hi << 32 | lo);
+}
+
+static void test_virtio_init(void) {
+    uint8_t *regions = virtio_topology();
+    struct virtio_device vdev;
+    CHECK(virtio_pci_init(&vdev, 0, 3, 0));
+    CHECK(vdev.common == (void *)regions);
+    CHECK(vdev.notify_base == regions + VIRTIO_TEST_NOTIFY);
+    CHECK_EQ(vdev.notify_off_multiplier, VIRTIO_TEST_NOTIFY_MULT);
+    CHECK(vdev.isr == regions + VIRTIO_TEST_ISR);
+    CHECK(vdev.device_cfg == regions + VIRTIO_TEST_DEVICE);
+    CHECK_EQ(vdev.device_cfg_len, 60);
+    CHECK(vdev.msix_cap != 0);
+    CHECK_EQ(vdev.common->device_status,
+             VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    CHECK(pci_read_config(PCI_CONFIG_ADDRESS(0, 3, 0, PCI_COMMAND_OFFSET)) &
+          PCI_COMMAND_BUS_MASTER);
+
+    // Feature bit 0 is offered but not wanted; VERSION_1 is always taken
+    vdev.common->device_feature = (1u << 29) | (1u << 0);
+    CHECK(
+        virtio_negotiate_features(&vdev, VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX)));
+    CHECK_EQ(vdev.features, VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX) |
+                                VIRTIO_FEATURE(VIRTIO_F_VERSION_1));
+    CHECK(vdev.common->device_status & VIRTIO_STATUS_FEATURES_OK);
+
+    // Not a virtio function
+    CHECK(!virtio_pci_init(&vdev, 0, 0, 0));
+}
+
+static uint8_t queue_mem[4096] __attribute__((aligned(16)));
+static int tokens[16];
+
+/* The device side of a split ring: consumes the next avail entry and
+ * returns it as used */
+struct split_device {
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint16_t num;
+    uint16_t next_avail;
+};
+
+static void split_complete(struct split_device *dev, uint32_t len) {
+    uint16_t head = dev->avail->ring[dev->next_avail++ % dev->num];
+    dev->used->ring[dev->used->idx % dev->num] =
+        (struct virtq_used_elem){.id = head, .len = len};
+    dev->used->idx++;
+}
+
+static void test_virtq_split(void) {
+    uint8_t *regions = virtio_topology();
+    volatile uint16_t *notify =
+        (volatile uint16_t *)(regions + VIRTIO_TEST_NOTIFY);
+    struct virtio_device vdev;
+    CHECK(virtio_start(&vdev, regions, false));
+    CHECK(!virtio_has_feature(&vdev, VIRTIO_F_RING_PACKED));
+
+    // 6 is clamped to the power of two below it
+    struct virtq vq;
+    CHECK(virtq_mem_size(4, false) <= sizeof(queue_mem));
+    CHECK(virtq_setup(&vdev, &vq, VIRTIO_TEST_QUEUE, 6, queue_mem,
+                      VIRTIO_MSI_NO_VECTOR));
+    struct virtio_pci_common_cfg *common = (void *)regions;
+    CHECK_EQ(common->queue_size, 4);
+    CHECK_EQ(common->queue_enable, 1);
+    struct split_device dev = {
+        .desc = queue_address(common->queue_desc_lo, common->queue_desc_hi),
+        .avail =
+            queue_address(common->queue_driver_lo, common->queue_driver_hi),
+        .used =
+            queue_address(common->queue_device_lo, common->queue_device_hi),
+        .num = 4};
+    CHECK((void *)dev.desc == queue_mem);
+    uint16_t *avail_event = (uint16_t *)&dev.used->ring[dev.num];
+    uint16_t *used_event = &dev.avail->ring[dev.num];
+
+    // Chains are published by the kick, not by virtq_add
+    struct virtq_buf request[2] = {{0x1000, 16}, {0x2000, 512}};
+    CHECK(virtq_add(&vq, request, 1, 1, &tokens[0]));
+    CHECK_EQ(dev.avail->idx, 0);
+    CHECK_EQ(dev.desc[0].flags, VIRTQ_DESC_F_NEXT);
+    CHECK_EQ(dev.desc[1].flags, VIRTQ_DESC_F_WRITE);
+    *notify = 0xFFFF;
+    CHECK(virtq_kick(&vq));
+    CHECK_EQ(dev.avail->idx, 1);
+    CHECK_EQ(*notify, VIRTIO_TEST_QUEUE);
+
+    // The device only wants to hear about avail index 6 and later
+    *avail_event = 5;
+    CHECK(virtq_add(&vq, request, 1, 0, &tokens[1]));
+    *notify = 0xFFFF;
+    CHECK(!virtq_kick(&vq));
+    CHECK_EQ(*notify, 0xFFFF);
+    CHECK(!virtq_kick(&vq));
+
+    // One descriptor left: a two-buffer chain does not fit
+    CHECK_EQ(vq.num_free, 1);
+    CHECK(!virtq_add(&vq, request, 1, 1, &tokens[2]));
+
+    uint32_t len = 0;
+    CHECK(virtq_get_used(&vq, &len) == NULL);
+    split_complete(&dev, 512);
+    split_complete(&dev, 0);
+    CHECK(virtq_get_used(&vq, &len) == &tokens[0]);
+    CHECK_EQ(len, 512);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[1]);
+    CHECK(virtq_get_used(&vq, NULL) == NULL);
+    CHECK_EQ(*used_event, 2);
+    CHECK_EQ(vq.num_free, 4);
+
+    // Ten more round trips wrap the ring positions and recycle descriptors
+    for (int i = 0; i < 10; i++) {
+        *avail_event = dev.avail->idx;
+        CHECK(virtq_add(&vq, request, 1, 1, &tokens[i]));
+        CHECK(virtq_kick(&vq));
+        split_complete(&dev, i);
+        CHECK(virtq_get_used(&vq, &len) == &tokens[i]);
+        CHECK_EQ(len, i);
+    }
+    CHECK_EQ(dev.avail->idx, 12);
+    CHECK_EQ(dev.used->idx, 12);
+    CHECK_EQ(vq.num_free, 4);
+
+    // No interrupts while polling; a late completion is reported on enable
+    virtq_disable_cb(&vq);
+    CHECK_EQ(dev.avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
+    CHECK(virtq_add(&vq, request, 1, 0, &tokens[0]));
+    virtq_kick(&vq);
+    split_complete(&dev, 0);
+    CHECK(!virtq_enable_cb(&vq));
+    CHECK_EQ(dev.avail->flags, 0);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[0]);
+    CHECK(virtq_enable_cb(&vq));
+}
+
+/* The device side of a packed ring, completing chains in order */
+struct packed_device {
+    struct virtq_packed_desc *desc;
+    struct virtq_event_suppress *driver;
+    struct virtq_event_suppress *device;
+    uint16_t num;
+    uint16_t next;
+    bool wrap;
+};
+
+static bool packed_available(const struct packed_device *dev) {
+    uint16_t flags = dev->desc[dev->next].flags;
+    return (bool)(flags & VIRTQ_DESC_F_AVAIL) == dev->wrap &&
+           (bool)(flags & VIRTQ_DESC_F_USED) != dev->wrap;
+}
+
+/* Writes one used descriptor over the head of the next chain */
+static void packed_complete(struct packed_device *dev, uint32_t len) {
+    uint16_t head = dev->next;
+    bool head_wrap = dev->wrap;
+    uint16_t id = dev->desc[head].id;
+    uint16_t flags;
+    do {
+        flags = dev->desc[dev->next].flags;
+        if (++dev->next == dev->num) {
+            dev->next = 0;
+            dev->wrap = !dev->wrap;
+        }
+    } while (flags & VIRTQ_DESC_F_NEXT);
+    dev->desc[head].id = id;
+    dev->desc[head].len = len;
+    dev->desc[head].flags =
+        head_wrap ? VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED : 0;
+}
+
+static void test_virtq_packed(void) {
+    uint8_t *regions = virtio_topology();
+    volatile uint16_t *notify =
+        (volatile uint16_t *)(regions + VIRTIO_TEST_NOTIFY);
+    struct virtio_device vdev;
+    CHECK(virtio_start(&vdev, regions, true));
+    CHECK(virtio_has_feature(&vdev, VIRTIO_F_RING_PACKED));
+
+    struct virtq vq;
+    CHECK(virtq_mem_size(4, true) <= sizeof(queue_mem));
+    CHECK(virtq_setup(&vdev, &vq, VIRTIO_TEST_QUEUE, 4, queue_mem,
+                      VIRTIO_MSI_NO_VECTOR));
+    struct virtio_pci_common_cfg *common = (void *)regions;
+    struct packed_device dev = {
+        .desc = queue_address(common->queue_desc_lo, common->queue_desc_hi),
+        .driver =
+            queue_address(common->queue_driver_lo, common->queue_driver_hi),
+        .device =
+            queue_address(common->queue_device_lo, common->queue_device_hi),
+        .num = 4,
+        .wrap = true};
+
+    // The first lap marks descriptors available with the AVAIL bit
+    struct virtq_buf request[2] = {{0x1000, 16}, {0x2000, 512}};
+    CHECK(virtq_add(&vq, request, 1, 1, &tokens[0]));
+    CHECK(packed_available(&dev));
+    CHECK_EQ(dev.desc[0].flags, VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_NEXT);
+    CHECK_EQ(dev.desc[1].flags, VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_WRITE);
+    *notify = 0xFFFF;
+    CHECK(virtq_kick(&vq));
+    CHECK_EQ(*notify, VIRTIO_TEST_QUEUE);
+
+    // Notifications off, then only once slot 0 of the next lap (wrap counter
+    // 0) is made available
+    dev.device->flags = VIRTQ_EVENT_F_DISABLE;
+    CHECK(virtq_add(&vq, request, 1, 0, &tokens[1]));
+    CHECK(!virtq_kick(&vq));
+    dev.device->flags = VIRTQ_EVENT_F_DESC;
+    dev.device->off_wrap = 0;
+    CHECK(virtq_add(&vq, request, 0, 1, &tokens[2]));
+    CHECK(!virtq_kick(&vq));
+    CHECK_EQ(vq.num_free, 0);
+    CHECK(!virtq_add(&vq, request, 1, 0, &tokens[3]));
+
+    packed_complete(&dev, 512);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[0]);
+    CHECK(virtq_get_used(&vq, NULL) == NULL);
+    CHECK(virtq_add(&vq, request, 1, 0, &tokens[3]));
+    *notify = 0xFFFF;
+    CHECK(virtq_kick(&vq));
+    CHECK_EQ(*notify, VIRTIO_TEST_QUEUE);
+
+    // The second lap flips the wrap counter: USED set, AVAIL clear
+    CHECK_EQ(dev.desc[0].flags, VIRTQ_DESC_F_USED);
+    packed_complete(&dev, 0);
+    packed_complete(&dev, 0);
+    packed_complete(&dev, 0);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[1]);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[2]);
+    CHECK(virtq_get_used(&vq, NULL) == &tokens[3]);
+    CHECK_EQ(vq.num_free, 4);
+    // The used event follows the driver's position and wrap counter
+    CHECK_EQ(dev.driver->off_wrap, 1);
+
+    dev.device->flags = VIRTQ_EVENT_F_ENABLE;
+    uint32_t len = 0;
+    for (int i = 0; i < 9; i++) {
+        CHECK(virtq_add(&vq, request, 1, 1, &tokens[i]));
+        CHECK(virtq_kick(&vq));
+        packed_complete(&dev, i);
+        CHECK(virtq_get_used(&vq, &len) == &tokens[i]);
+        CHECK_EQ(len, i);
+    }
+    CHECK_EQ(vq.num_free, 4);
+    CHECK(virtq_get_used(&vq, NULL) == NULL);
+}
+
+/* Drivers matched by test_driver_match() */
+static const struct pci_device_id exact_ids[] = {
+    PCI_DEVICE(0x1AF4, 0x1042),
+    {0},
+};
+static const struct pci_device_id storage_ids[] = {
+    PCI_DEVICE_CLASS(0x010601, 0xFFFFFF),
+    {0},
+};
+static const struct pci_device_id any_class_ids[] = {
+    /* Every function with prog-if 0x30, whatever its class */
+    PCI_DEVICE_CLASS(0x000030, 0x0000FF),
+    {0},
+};
+
+PCI_DRIVER(test_exact) = {.name = "exact", .id_table = exact_ids};
+PCI_DRIVER(test_storage) = {.name = "storage", .id_table = storage_ids};
+PCI_DRIVER(test_any_class) = {.name = "any", .id_table = any_class_ids};
+
+static const char *driver_name(uint16_t vendor_id, uint16_t device_id,
+                               uint32_t class_code) {
+    struct pci_function fn = {.vendor_id = vendor_id,
+                              .device_id = device_id,
+                              .class_code = class_code};
+    const struct pci_driver *driver = pci_match_driver(&fn, NULL);
+    return driver ? driver->name : "none";
+}
+
+static void test_driver_match(void) {
+    CHECK(same(driver_name(0x1AF4, 0x1042, 0x010000), "exact"));
+    CHECK(same(driver_name(0x8086, 0x2922, 0x010601), "storage"));
+    CHECK(same(driver_name(0x8086, 0x1E31, 0x0C0330), "any"));
+    CHECK(same(driver_name(0x8086, 0x2918, 0x060100), "none"));
+    CHECK_EQ(pci_driver_dropped_ids(), 0);
+}
+
+#define SNAPSHOT_ENTRIES 8
+static uint8_t snapshot_mem[2][PCI_SNAPSHOT_SIZE(SNAPSHOT_ENTRIES)]
+    __attribute__((aligned(8)));
+
+struct diff_counts {
+    uint32_t added;
+    uint32_t removed;
+    uint32_t changed;
+};
+
+static void count_diff(pci_snapshot_change_t change,
+                       const struct pci_snapshot_entry *old_entry,
+                       const struct pci_snapshot_entry *new_entry, void *ctx) {
+    struct diff_counts *counts = ctx;
+    switch (change) {
+        case PCI_SNAPSHOT_ADDED:
+            check(!old_entry && new_entry, "added entry", __LINE__);
+            counts->added++;
+            break;
+        case PCI_SNAPSHOT_REMOVED:
+            check(old_entry && !new_entry, "removed entry", __LINE__);
+            counts->removed++;
+            break;
+        default:
+            check(old_entry && new_entry, "changed entry", __LINE__);
+            counts->changed++;
+            break;
+    }
+}
+
+static void test_snapshot_capture(void) {
+    struct pci_snapshot *snap = (struct pci_snapshot *)snapshot_mem[0];
+    uint32_t size = sizeof(snapshot_mem[0]);
+    int blk = small_topology();
+
+    CHECK_EQ(pci_snapshot_capture(snap, PCI_SNAPSHOT_SIZE(2)), 0);
+    CHECK_EQ(pci_snapshot_capture(snap, size), PCI_SNAPSHOT_SIZE(3));
+    CHECK_EQ(snap->count, 3);
+    CHECK(pci_snapshot_check(snap, size));
+    CHECK(!pci_snapshot_check(snap, PCI_SNAPSHOT_SIZE(3) - 1));
+    CHECK(pci_snapshot_validate(snap));
+
+    // Format checks, each undone before the next
+    snap->magic ^= 1;
+    CHECK(!pci_snapshot_check(snap, size));
+    snap->magic ^= 1;
+    snap->version++;
+    CHECK(!pci_snapshot_check(snap, size));
+    snap->version--;
+    snap->entries[2].bars[5] ^= 1;
+    CHECK(!pci_snapshot_check(snap, size));
+    snap->entries[2].bars[5] ^= 1;
+    CHECK(pci_snapshot_check(snap, size));
+
+    // Hardware changes under a well-formed snapshot
+    sim_config(blk)[2] ^= 1;
+    CHECK(!pci_snapshot_validate(snap));
+    sim_config(blk)[2] ^= 1;
+    sim_config(blk)[0x13] = 0xC1;
+    CHECK(!pci_snapshot_validate(snap));
+    sim_config(blk)[0x13] = 0;
+    CHECK(pci_snapshot_validate(snap));
+
+    const struct pci_snapshot_entry *entry = pci_snapshot_find(snap, 1, 0, 0);
+    CHECK(entry && entry->fn.vendor_id == 0x1AF4);
+    entry = pci_snapshot_find(snap, 0, 1, 0);
+    CHECK(entry && entry->fn.header_type == 0x01);
+    CHECK(pci_snapshot_find(snap, 0, 0, 0) == &snap->entries[0]);
+    CHECK(pci_snapshot_find(snap, 0, 2, 0) == NULL);
+    CHECK(pci_snapshot_find(snap, 1, 0, 1) == NULL);
+    CHECK(pci_snapshot_find(snap, 2, 0, 0) == NULL);
+}
+
+static void test_snapshot_boot(void) {
+    small_topology();
+    uint32_t size = PCI_SNAPSHOT_SIZE(SNAPSHOT_ENTRIES);
+    uint64_t phys = sim_add_ram(size);
+    bool warm = true;
+
+    struct pci_snapshot *snap = pci_snapshot_boot(phys, size, &warm);
+    CHECK(snap && !warm);
+    CHECK(snap && snap->count == 3);
+
+    sim_reset_stats();
+    CHECK(pci_snapshot_boot(phys, size, &warm) == snap);
+    CHECK(warm);
+    // IDs and BAR 0 of 3 functions, then 30 empty slots on bus 0 and 31 on
+    // bus 1
+    CHECK_EQ(sim_get_stats()->config_reads, 3 * 2 + 30 + 31);
+
+    // A device in a slot that was empty forces a new scan
+    sim_add_function(1, 4, 0, 0x8086, 0x100E, 0x020000);
+    CHECK(pci_snapshot_boot(phys, size, &warm) == snap);
+    CHECK(!warm);
+    CHECK(pci_snapshot_find(snap, 1, 4, 0) != NULL);
+    pci_snapshot_boot(phys, size, &warm);
+    CHECK(warm);
+
+    // A region too small for the topology is not left holding a snapshot
+    CHECK(pci_snapshot_boot(phys, PCI_SNAPSHOT_SIZE(2), &warm) == NULL);
+    CHECK(!warm);
+    CHECK(!pci_snapshot_check(snap, size));
+}
+
+static void test_snapshot_diff(void) {
+    struct pci_snapshot *old_snap = (struct pci_snapshot *)snapshot_mem[0];
+    struct pci_snapshot *new_snap = (struct pci_snapshot *)snapshot_mem[1];
+    uint32_t size = sizeof(snapshot_mem[0]);
+
+    small_topology();
+    pci_snapshot_capture(old_snap, size);
+    CHECK_EQ(pci_snapshot_diff(old_snap, old_snap, count_diff, NULL), 0);
+
+    // Host bridge revised, virtio-blk gone, two devices added on bus 0
+    sim_reset();
+    sim_add_function(0, 0, 0, 0x8086, 0x29C1, 0x060000);
+    sim_add_bridge(0, 1, 0, 1, 1);
+    sim_add_function(0, 2, 0, 0x1234, 0x1111, 0x030000);
+    sim_add_function(0, 3, 0, 0x8086, 0x100E, 0x020000);
+    pci_snapshot_capture(new_snap, size);
+
+    struct diff_counts counts = {0};
+    CHECK_EQ(pci_snapshot_diff(old_snap, new_snap, count_diff, &counts), 4);
+    CHECK_EQ(counts.added, 2);
+    CHECK_EQ(counts.removed, 1);
+    CHECK_EQ(counts.changed, 1);
+}
+
+/* Variable MTRRs with the valid bit set */
+static uint32_t mtrrs_in_use(void) {
+    uint32_t count = 0;
+    for (uint32_t n = 0; n < (io_rdmsr(MSR_MTRRCAP) & MTRRCAP_VCNT_MASK); n++) {
+        if (io_rdmsr(MSR_MTRR_PHYSMASK(n)) & MTRR_PHYSMASK_VALID) count++;
+    }
+    return count;
+}
+
+static void test_memtype_bars(void) {
+    // The simulated firmware marks the 1 GiB PCI hole at 0xC0000000 UC
+    sim_reset();
+    CHECK(memtype_init());
+    int fb = sim_add_function(0, 2, 0, 0x1234, 0x1111, 0x030000);
+    // Registers first, so the framebuffer sits inside the hole
+    uint64_t regs_base = sim_add_bar(fb, 2, 4096, false);
+    uint64_t fb_base = sim_add_bar(fb, 0, 16 << 20, true);
+    CHECK_EQ(memtype_get(fb_base), MEMTYPE_UC);
+    CHECK_EQ(mtrrs_in_use(), 1);
+
+    // The framebuffer is carved out of the UC hole
+    CHECK_EQ(memtype_map_bar(0, 2, 0, 0), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(fb_base), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(fb_base + (16 << 20) - 1), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(fb_base - 1), MEMTYPE_UC);
+    CHECK_EQ(memtype_get(fb_base + (16 << 20)), MEMTYPE_UC);
+    CHECK_EQ(memtype_get(0xFFFFF000), MEMTYPE_UC);
+    CHECK_EQ(memtype_get(0xC0000000 - 0x1000), MEMTYPE_WB);
+
+    // Registers stay UC, and mapping again changes nothing
+    CHECK_EQ(memtype_map_bar(0, 2, 0, 2), MEMTYPE_UC);
+    CHECK_EQ(memtype_get(regs_base), MEMTYPE_UC);
+    uint32_t used = mtrrs_in_use();
+    CHECK_EQ(memtype_map_bar(0, 2, 0, 0), MEMTYPE_WC);
+    CHECK_EQ(mtrrs_in_use(), used);
+
+    // A range that only partly overlaps the hole is refused
+    CHECK(!memtype_set_range(0xBFFFF000, 0x2000, MEMTYPE_WC));
+}
+
+static void test_memtype_vga_wc(void) {
+    sim_reset();
+    CHECK(memtype_init());
+    CHECK_EQ(memtype_get(VGA_BASE), MEMTYPE_UC);
+
+    // 0xB8000-0xBFFFF are bytes 6 and 7 of the 16 KiB fixed-range MTRR; the
+    // rest of the legacy VGA window stays UC
+    sim_reset_stats();
+    CHECK(memtype_set_vga_wc());
+    CHECK_EQ(io_rdmsr(MSR_MTRR_FIX16K_A0000), 0x0101000000000000ULL);
+    CHECK_EQ(memtype_get(VGA_BASE), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(VGA_BASE + MEMTYPE_VGA_TEXT_SIZE - 1), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(0xA0000), MEMTYPE_UC);
+    CHECK_EQ(memtype_get(VGA_BASE - 1), MEMTYPE_UC);
+    // MTRRs off, the fixed range, MTRRs on: all inside one cache-disabled
+    // window (the sim aborts on a write outside one)
+    CHECK_EQ(sim_get_stats()->cache_flushes, 2);
+    CHECK_EQ(sim_get_stats()->memory_type_writes, 3);
+    CHECK_EQ(io_rdmsr(MSR_MTRR_DEF_TYPE) & MTRR_DEF_TYPE_E, MTRR_DEF_TYPE_E);
+    CHECK_EQ(mtrrs_in_use(), 1);
+
+    // Already WC: nothing is written
+    sim_reset_stats();
+    CHECK(memtype_set_vga_wc());
+    CHECK_EQ(sim_get_stats()->memory_type_writes, 0);
+    CHECK_EQ(sim_get_stats()->cache_flushes, 0);
+
+    // With the fixed ranges off, a variable MTRR covers the text buffer
+    sim_reset();
+    struct io_cache_state state;
+    io_cache_disable(&state);
+    io_wrmsr(MSR_MTRR_DEF_TYPE,
+             io_rdmsr(MSR_MTRR_DEF_TYPE) & ~(uint64_t)MTRR_DEF_TYPE_FE);
+    io_cache_enable(&state);
+    CHECK(memtype_init());
+    CHECK(memtype_set_vga_wc());
+    CHECK_EQ(io_rdmsr(MSR_MTRR_FIX16K_A0000), 0);
+    CHECK_EQ(mtrrs_in_use(), 2);
+    CHECK_EQ(memtype_get(VGA_BASE), MEMTYPE_WC);
+    CHECK_EQ(memtype_get(VGA_BASE - 1), MEMTYPE_WB);
+}
+
+static void test_vga_print(void) {
+    sim_reset();
+    clear();
+
+    // DEL is dropped; a CP437 byte is stored as it is
+    print("a\x7F" "b\xB0");
+    CHECK_EQ(sim_vga_buffer[0], 0x0F00 | 'a');
+    CHECK_EQ(sim_vga_buffer[1], 0x0F00 | 'b');
+    CHECK_EQ(sim_vga_buffer[2], 0x0FB0);
+
+    // 65536 clamps to 9999 rows up instead of wrapping to 0 (one row)
+    set_cursor(0, 10);
+    print("\x1B[65536Ax");
+    CHECK_EQ(sim_vga_buffer[0], 0x0F00 | 'x');
+
+    // A carriage return inside a sequence runs at once; the sequence goes on
+    set_cursor(10, 5);
+    print("\x1B[2\rCz");
+    CHECK_EQ(sim_vga_buffer[5 * COLS + 2], 0x0F00 | 'z');
+
+    // A ninth parameter is dropped instead of being added to the eighth
+    set_cursor(0, 6);
+    print("\x1B[0;0;0;0;0;0;0;31;32mr\x1B[0m");
+    CHECK_EQ(sim_vga_buffer[6 * COLS], (COLOR_RED << 8) | 'r');
+
+    // CAN aborts a sequence; what follows is text
+    set_cursor(0, 7);
+    print("\x1B[31\x18m");
+    CHECK_EQ(sim_vga_buffer[7 * COLS], 0x0F00 | 'm');
+
+    // newline() scrolls in the SGR background, as '\n' does
+    print("\x1B[44m");
+    set_cursor(0, ROWS - 1);
+    newline();
+    CHECK_EQ(sim_vga_buffer[(ROWS - 1) * COLS], 0x1F00 | ' ');
+    print("\x1B[0m");
+}
+
+static void test_perf(void) {
+    sim_reset();
+    clear();
+    perf_reset();
+
+    // 0 and 1 share bucket 0; 2^40 lands in the last bucket
+    const uint64_t samples[] = {0, 1, 2, 3, 100, 1ULL << 40};
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        perf_record(PERF_VIRTQ_KICK, samples[i]);
+    }
+    const struct perf_stat *stat = perf_get(PERF_VIRTQ_KICK);
+    CHECK_EQ(stat->calls, 6);
+    CHECK_EQ(stat->min_cycles, 0);
+    CHECK_EQ(stat->max_cycles, 1ULL << 40);
+    CHECK_EQ(stat->total_cycles, (1ULL << 40) + 106);
+    CHECK_EQ(stat->hist[0], 2);
+    CHECK_EQ(stat->hist[1], 2);
+    CHECK_EQ(stat->hist[6], 1);
+    CHECK_EQ(stat->hist[PERF_HIST_BUCKETS - 1], 1);
+    uint32_t total = 0;
+    for (int bucket = 0; bucket < PERF_HIST_BUCKETS; bucket++) {
+        total += stat->hist[bucket];
+    }
+    CHECK_EQ(total, 6);
+
+    // Events past the table are dropped
+    perf_record(PERF_EVENT_COUNT, 5);
+    CHECK(perf_get(PERF_EVENT_COUNT) == NULL);
+
+    // Only events that were hit are listed, and the dump does not count
+    // its own VGA writes
+    set_cursor(0, 0);
+    perf_dump(PERF_SINK_VGA);
+    CHECK(same(screen_row(0), "perf: calls / min / avg / max cycles"));
+    CHECK(same(screen_row(1),
+               "virtq_kick: 6 / 0 / 183251937980 / 1099511627776"));
+    CHECK(same(screen_row(2), "  2^0:2 2^1:2 2^6:1 2^31:1"));
+    CHECK(same(screen_row(3), ""));
+    CHECK_EQ(perf_get(PERF_VGA_RUN)->calls, 0);
+    CHECK_EQ(perf_get(PERF_VGA_FLUSH)->calls, 0);
+
+    // Recording resumes after the dump
+    perf_record(PERF_VIRTQ_KICK, 7);
+    CHECK_EQ(stat->calls, 7);
+    CHECK_EQ(stat->min_cycles, 0);
+    perf_reset();
+    CHECK_EQ(stat->calls, 0);
+    CHECK_EQ(stat->hist[0], 0);
+}
+
+int main(void) {
+    test_enumerate_reads();
+    test_iter_filters();
+    test_msix_placement();
+    test_msix_moderation();
+    test_virtio_init();
+    test_virtq_split();
+    test_virtq_packed();
+    test_driver_match();
+    test_snapshot_capture();
+    test_snapshot_boot();
+    test_snapshot_diff();
+    test_memtype_bars();
+    test_memtype_vga_wc();
+    test_vga_print();
+    test_perf();
+
+    if (failures) {
+        printf("sim_test: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("sim_test: all checks passed\n");
+    return 0;
+}
@@ -1,11 +1,33 @@
 #include "vga.h"
 
+#include <memtype.h>
+#include <perf.h>
+
+#ifdef DSP_HOST_SIM
+#include <sim.h>
+u16 *const video = sim_vga_buffer;
+#else
 u16 *const video = (u16 *)VGA_BASE;
+#endif
 
 /* Keeps track of the current cursor position */
 static u8 cursor_x = 0;
 static u8 cursor_y = 0;
 
+/* Scroll up by copying rows up one line and fill the last row with blank */
+static void scroll(u16 blank) {
+    PERF_BEGIN(PERF_VGA_SCROLL);
+    for (u8 y = 1; y < ROWS; y++) {
+        for (u8 x = 0; x < COLS; x++) {
+            video[(y - 1) * COLS + x] = video[y * COLS + x];
+        }
+    }
+    for (u8 x = 0; x < COLS; x++) {
+        video[(ROWS - 1) * COLS + x] = blank;
+    }
+    PERF_END(PERF_VGA_SCROLL);
+}
+
 void putc(u8 x, u8 y, VGA_Color fg, VGA_Color bg, char c) {
     if (x >= COLS || y >= ROWS) return;
 
@@ -14,10 +36,13 @@ void putc(u8 x, u8 y, VGA_Color fg, VGA_Color bg, char c) {
 }
 
 void clear() {
+    PERF_BEGIN(PERF_VGA_CLEAR);
     cursor_x = 0;
     cursor_y = 0;
     for (u8 y = 0; y < ROWS; y++)
         for (u8 x = 0; x < COLS; x++) putc(x, y, COLOR_BLACK, COLOR_BLACK, ' ');
+    vga_flush();
+    PERF_END(PERF_VGA_CLEAR);
 }
 
 void clear_screen(){
@@ -25,6 +50,7 @@ void clear_screen(){
 }
 
 void print_char(VGA_Color fg, VGA_Color bg, char c) {
+    PERF_BEGIN(PERF_VGA_CHAR);
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
@@ -42,23 +68,244 @@ void print_char(VGA_Color fg, VGA_Color bg, char c) {
     }
     if (cursor_y >= ROWS) {
         cursor_y = ROWS - 1;
-        // Scroll up by copying rows up one line
-        for (u8 y = 1; y < ROWS; y++) {
-            for (u8 x = 0; x < COLS; x++) {
-                video[(y - 1) * COLS + x] = video[y * COLS + x];
-            }
+        scroll((bg << 12) | (bg << 8) | ' ');
+    }
+    PERF_END(PERF_VGA_CHAR);
+}
+
+/* Escape sequence parser; kept across print() calls */
+#define ANSI_ESC 0x1B
+#define ANSI_MAX_PARAMS 8
+#define ANSI_MAX_VALUE 9999
+
+static enum { ANSI_TEXT, ANSI_ESCAPE, ANSI_CSI } ansi_state = ANSI_TEXT;
+static u16 ansi_params[ANSI_MAX_PARAMS];
+static u8 ansi_param_count = 0;
+/* Set by a private marker such as '?'; the sequence is then ignored */
+static u8 ansi_private = 0;
+/* Set once the sequence has more than ANSI_MAX_PARAMS parameters; the
+ * digits of the extra ones are dropped */
+static u8 ansi_overflow = 0;
+
+/* Current SGR attributes */
+static VGA_Color ansi_fg = COLOR_WHITE;
+static VGA_Color ansi_bg = COLOR_BLACK;
+static u8 ansi_bold = 0;
+
+/* ANSI colour order: black, red, green, yellow, blue, magenta, cyan, white */
+static const VGA_Color ansi_colors[8] = {
+    COLOR_BLACK, COLOR_RED,     COLOR_GREEN, COLOR_BROWN,
+    COLOR_BLUE,  COLOR_MAGENTA, COLOR_CYAN,  COLOR_LIGHT_GRAY};
+
+static u8 ansi_color() {
+    return (ansi_bg << 4) | (ansi_bold ? (ansi_fg | 0x8) : ansi_fg);
+}
+
+static void line_feed(u16 blank) {
+    cursor_x = 0;
+    cursor_y++;
+    if (cursor_y >= ROWS) {
+        cursor_y = ROWS - 1;
+        scroll(blank);
+    }
+}
+
+/* Bytes stored as glyphs. DEL is a control character and is dropped. Bytes
+ * 0x80-0xFF are stored as they are, showing the code page 437 glyphs of the
+ * VGA font (box drawing, accented letters). */
+static int ansi_printable(char c) { return (u8)c >= ' ' && (u8)c != 0x7F; }
+
+/* Writes a run of printable characters, up to the end of the current row,
+ * straight into the buffer; returns where the run stopped */
+static const char *put_run(const char *s, u8 color) {
+    PERF_BEGIN(PERF_VGA_RUN);
+    u16 attr = color << 8;
+    u16 *cell = &video[cursor_y * COLS + cursor_x];
+    u16 *end = &video[cursor_y * COLS + COLS];
+    while (cell < end && ansi_printable(*s)) {
+        *cell++ = attr | (u8)*s++;
+    }
+    cursor_x = COLS - (end - cell);
+    if (cursor_x >= COLS) line_feed(attr | ' ');
+    PERF_END(PERF_VGA_RUN);
+    return s;
+}
+
+static void fill(u16 from, u16 to, u16 blank) {
+    PERF_BEGIN(PERF_VGA_CLEAR);
+    for (u16 i = from; i < to; i++) video[i] = blank;
+    PERF_END(PERF_VGA_CLEAR);
+}
+
+static void ansi_sgr(u16 code) {
+    if (code == 0) {
+        ansi_fg = COLOR_WHITE;
+        ansi_bg = COLOR_BLACK;
+        ansi_bold = 0;
+    } else if (code == 1) {
+        ansi_bold = 1;
+    } else if (code == 22) {
+        ansi_bold = 0;
+    } else if (code >= 30 && code <= 37) {
+        ansi_fg = ansi_colors[code - 30];
+    } else if (code == 39) {
+        ansi_fg = COLOR_WHITE;
+    } else if (code >= 40 && code <= 47) {
+        ansi_bg = ansi_colors[code - 40];
+    } else if (code == 49) {
+        ansi_bg = COLOR_BLACK;
+    } else if (code >= 90 && code <= 97) {
+        ansi_fg = ansi_colors[code - 90] | 0x8;
+    } else if (code >= 100 && code <= 107) {
+        // Shows as blinking unless the attribute controller disables blink
+        ansi_bg = ansi_colors[code - 100] | 0x8;
+    }
+}
+
+/* Clamps a count parameter, where 0 means 1 */
+static int ansi_count(u8 index) {
+    u16 value = index < ansi_param_count ? ansi_params[index] : 0;
+    return value ? value : 1;
+}
+
+static int ansi_clamp(int value, int limit) {
+    return value < 0 ? 0 : (value >= limit ? limit - 1 : value);
+}
+
+static void ansi_dispatch(char final) {
+    u16 blank = (ansi_color() << 8) | ' ';
+    u16 here = cursor_y * COLS + cursor_x;
+    u16 mode = ansi_params[0];
+
+    switch (final) {
+        case 'm':
+            for (u8 i = 0; i < ansi_param_count; i++) ansi_sgr(ansi_params[i]);
+            break;
+        case 'H':
+        case 'f':
+            cursor_y = ansi_clamp(ansi_count(0) - 1, ROWS);
+            cursor_x = ansi_clamp(ansi_count(1) - 1, COLS);
+            break;
+        case 'A':
+            cursor_y = ansi_clamp(cursor_y - ansi_count(0), ROWS);
+            break;
+        case 'B':
+            cursor_y = ansi_clamp(cursor_y + ansi_count(0), ROWS);
+            break;
+        case 'C':
+            cursor_x = ansi_clamp(cursor_x + ansi_count(0), COLS);
+            break;
+        case 'D':
+            cursor_x = ansi_clamp(cursor_x - ansi_count(0), COLS);
+            break;
+        case 'G':
+            cursor_x = ansi_clamp(ansi_count(0) - 1, COLS);
+            break;
+        case 'J':
+            if (mode == 0) fill(here, ROWS * COLS, blank);
+            if (mode == 1) fill(0, here + 1, blank);
+            if (mode == 2) fill(0, ROWS * COLS, blank);
+            break;
+        case 'K':
+            if (mode == 0) fill(here, cursor_y * COLS + COLS, blank);
+            if (mode == 1) fill(cursor_y * COLS, here + 1, blank);
+            if (mode == 2) fill(cursor_y * COLS, cursor_y * COLS + COLS, blank);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Cancel and Substitute abort an escape sequence */
+#define ANSI_CAN 0x18
+#define ANSI_SUB 0x1A
+
+/* Runs a C0 control character other than ESC */
+static void ansi_control(char c) {
+    if (c == '\n') {
+        line_feed((ansi_color() << 8) | ' ');
+    } else if (c == '\r') {
+        cursor_x = 0;
+    } else if (c == '\b') {
+        if (cursor_x > 0) cursor_x--;
+    } else if (c == '\t') {
+        cursor_x += 4 - (cursor_x % 4);
+        if (cursor_x >= COLS) line_feed((ansi_color() << 8) | ' ');
+    }
+    // Other control characters are ignored, as on a terminal
+}
+
+/* Feeds one character that is not part of a plain run */
+static void ansi_feed(char c) {
+    // As on a VT100, control characters inside a sequence run at once and
+    // the sequence carries on; CAN and SUB abort it
+    if (ansi_state != ANSI_TEXT && (u8)c < ' ' && c != ANSI_ESC) {
+        if (c == ANSI_CAN || c == ANSI_SUB) {
+            ansi_state = ANSI_TEXT;
+        } else {
+            ansi_control(c);
         }
-        // Clear the last row
-        for (u8 x = 0; x < COLS; x++) {
-            putc(x, ROWS - 1, bg, bg, ' ');
+        return;
+    }
+
+    switch (ansi_state) {
+        case ANSI_TEXT:
+            if (c == ANSI_ESC) {
+                ansi_state = ANSI_ESCAPE;
+            } else {
+                ansi_control(c);
+            }
+            break;
+        case ANSI_ESCAPE:
+            if (c == '[') {
+                for (u8 i = 0; i < ANSI_MAX_PARAMS; i++) ansi_params[i] = 0;
+                ansi_param_count = 1;
+                ansi_private = 0;
+                ansi_overflow = 0;
+                ansi_state = ANSI_CSI;
+            } else {
+                ansi_state = ANSI_TEXT;
+            }
+            break;
+        case ANSI_CSI: {
+            u16 *param = &ansi_params[ansi_param_count - 1];
+            if (c >= '0' && c <= '9') {
+                if (ansi_overflow) break;
+                // Clamped before the multiply so long digit strings cannot
+                // wrap the u16
+                *param = *param > ANSI_MAX_VALUE / 10
+                             ? ANSI_MAX_VALUE
+                             : *param * 10 + (c - '0');
+            } else if (c == ';') {
+                if (ansi_param_count < ANSI_MAX_PARAMS) {
+                    ansi_param_count++;
+                } else {
+                    ansi_overflow = 1;
+                }
+            } else if (c >= '<' && c <= '?') {
+                ansi_private = 1;
+            } else if (c >= '@' && c <= '~') {
+                if (!ansi_private) ansi_dispatch(c);
+                ansi_state = ANSI_TEXT;
+            } else if (c == ANSI_ESC) {
+                ansi_state = ANSI_ESCAPE;
+            }
+            break;
         }
     }
 }
 
 void print(const char *s) {
-    for (; *s; s++) {
-        print_char(COLOR_WHITE, COLOR_BLACK, *s);
+    while (*s) {
+        // Fast path: everything up to the next control character or the end
+        // of the row is stored without going through the parser
+        if (ansi_state == ANSI_TEXT && ansi_printable(*s)) {
+            s = put_run(s, ansi_color());
+        } else {
+            ansi_feed(*s++);
+        }
     }
+    vga_flush();
 }
 
 void show(const char *s) { print(s); }
@@ -97,6 +344,7 @@ void print_colored(const char *string, VGA_Color textColor,
                    VGA_Color background) {
     u8 color = (background << 4) | textColor;
     for (; *string; string++) {
+        PERF_BEGIN(PERF_VGA_CHAR);
         if (*string == '\n') {
             cursor_x = 0;
             cursor_y++;
@@ -113,26 +361,22 @@ void print_colored(const char *string, VGA_Color textColor,
 
         if (cursor_y >= ROWS) {
             cursor_y = ROWS - 1;
-            // Scroll up by moving all rows up
-            for (u8 y = 1; y < ROWS; y++) {
-                for (u8 x = 0; x < COLS; x++) {
-                    video[(y - 1) * COLS + x] = video[y * COLS + x];
-                }
-            }
-            // Clear the last row
-            for (u8 x = 0; x < COLS; x++) {
-                video[(ROWS - 1) * COLS + x] = (color << 8) | ' ';
-            }
+            scroll((color << 8) | ' ');
         }
+        PERF_END(PERF_VGA_CHAR);
     }
+    vga_flush();
 }
 
 void clear_line(int line) {
     if (line < 0 || line >= ROWS) return;
 
+    PERF_BEGIN(PERF_VGA_CLEAR);
     for (int x = 0; x < COLS; x++) {
         video[line * COLS + x] = (0x0 << 12) | ' ';  // Default black background
     }
+    vga_flush();
+    PERF_END(PERF_VGA_CLEAR);
 }
 
 void set_cursor(int x, int y) {
@@ -152,4 +396,14 @@ void print_hex(uint32_t value) {
     print(buffer);
 }
 
-void newline() { print_char(COLOR_GREEN, COLOR_BLACK, '\n'); }
\ No newline at end of file
+void newline() {
+    line_feed((ansi_color() << 8) | ' ');
+    vga_flush();
+}
+
+// A single sfence drains the write-combining buffers of the whole run
+void vga_flush() {
+    PERF_BEGIN(PERF_VGA_FLUSH);
+    memtype_sfence();
+    PERF_END(PERF_VGA_FLUSH);
+}
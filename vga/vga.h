@@ -43,6 +43,14 @@ typedef enum {
     COLOR_WHITE = 0xF
 } VGA_Color;
 
+/* ANSI/VT100 escape sequences understood by print() */
+#define ANSI_SGR(n) "\x1b[" #n "m"
+#define ANSI_RESET ANSI_SGR(0)
+#define ANSI_BOLD ANSI_SGR(1)
+#define ANSI_GOTO(row, col) "\x1b[" #row ";" #col "H"
+#define ANSI_CLEAR "\x1b[2J\x1b[H"
+#define ANSI_CLEAR_LINE "\x1b[2K"
+
 /* Main functions */
 
 /**
@@ -69,10 +77,13 @@ void clear();
 void print_char(VGA_Color fg, VGA_Color bg, char c);
 
 /**
- * @brief Display a string at the current cursor position
+ * @brief Display a string at the current cursor position, interpreting
+ * ANSI/VT100 escape sequences: SGR colours (ESC[...m), cursor positioning
+ * (ESC[row;colH, ESC[nA/B/C/D, ESC[nG) and erase in display/line (ESC[nJ,
+ * ESC[nK). Text is drawn in the colours set by the last SGR sequence, white
+ * on black until then. Unknown sequences are dropped. The parser state
+ * persists across calls, so a sequence may be split between them.
  * @param s The string to print
- * @param fg The foreground color of the character
- * @param bg The background color of the character
  */
 void print(const char *s);
 
@@ -136,4 +147,11 @@ void newline();
  */
 void clear_screen();
 
+/**
+ * @brief Makes all earlier writes to the text buffer globally visible.
+ * Only needed when the buffer is mapped write-combining (see memtype.h);
+ * print, print_colored, clear and clear_line already end with it.
+ */
+void vga_flush();
+
 #endif
\ No newline at end of file
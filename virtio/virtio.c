@@ -0,0 +1,534 @@
+#include <io.h>
+#include <perf.h>
+#include <virtio.h>
+
+/* Rings live in write-back memory, where x86 keeps stores (and loads) in
+ * program order, so only the compiler needs fencing. Publishing the avail
+ * index and then reading the device's event index is a store->load pair and
+ * needs a real fence. */
+#define virtio_barrier() __asm__ volatile("" ::: "memory")
+#define virtio_mb() __asm__ volatile("mfence" ::: "memory")
+
+/* The library runs identity mapped, so ring addresses are their pointers */
+#define VIRTIO_PHYS(ptr) ((uint64_t)(uintptr_t)(ptr))
+
+#define VIRTQ_ALIGN 16
+
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+/* Offsets of the rings and the per-buffer state inside the queue memory */
+struct virtq_layout {
+    size_t driver;
+    size_t device;
+    size_t tokens;
+    size_t id_next;
+    size_t id_count;
+    size_t size;
+};
+
+static void virtq_compute_layout(uint16_t num, bool packed,
+                                 struct virtq_layout *layout) {
+    size_t offset;
+    if (packed) {
+        offset = sizeof(struct virtq_packed_desc) * num;
+        layout->driver = align_up(offset, VIRTQ_ALIGN);
+        offset = layout->driver + sizeof(struct virtq_event_suppress);
+        layout->device = align_up(offset, VIRTQ_ALIGN);
+        offset = layout->device + sizeof(struct virtq_event_suppress);
+    } else {
+        offset = sizeof(struct virtq_desc) * num;
+        layout->driver = align_up(offset, VIRTQ_ALIGN);
+        // flags, idx, ring[num], used_event
+        offset = layout->driver + sizeof(uint16_t) * (3 + num);
+        layout->device = align_up(offset, VIRTQ_ALIGN);
+        // flags, idx, ring[num], avail_event
+        offset = layout->device + sizeof(uint16_t) * 3 +
+                 sizeof(struct virtq_used_elem) * num;
+    }
+    layout->tokens = align_up(offset, VIRTQ_ALIGN);
+    layout->id_next = layout->tokens + sizeof(void *) * num;
+    layout->id_count = layout->id_next + sizeof(uint16_t) * num;
+    layout->size = align_up(layout->id_count + sizeof(uint16_t) * num,
+                            VIRTQ_ALIGN);
+}
+
+/* True if the device asked to be notified when the index moved from old to
+ * new, given the event index it published (virtio 1.x, 2.7.10 / 2.8.21). */
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx,
+                                    uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static void virtio_set_status(struct virtio_device *vdev, uint8_t bits) {
+    vdev->common->device_status = vdev->common->device_status | bits;
+}
+
+bool virtio_pci_init(struct virtio_device *vdev, uint8_t bus, uint8_t device,
+                     uint8_t function) {
+    if (getVID(bus, device, function) != VIRTIO_PCI_VENDOR_ID) {
+        return false;
+    }
+
+    *vdev = (struct virtio_device){0};
+    vdev->bus = bus;
+    vdev->device = device;
+    vdev->function = function;
+
+    // Each region is described by its own vendor-specific capability; the
+    // spec says to use the first one of each type we can handle.
+    for (uint8_t cap = pci_find_capability(bus, device, function,
+                                           VIRTIO_PCI_CAP_ID, 0);
+         cap;
+         cap = pci_find_capability(bus, device, function, VIRTIO_PCI_CAP_ID,
+                                   cap)) {
+        uint32_t header =
+            pci_read_config(PCI_CONFIG_ADDRESS(bus, device, function, cap));
+        uint8_t cfg_type = (header >> (VIRTIO_PCI_CAP_CFG_TYPE * 8)) & 0xFF;
+        // The PCI_CFG access window and unknown types are not mapped; QEMU
+        // points the former at BAR 0, which may not exist
+        if (cfg_type < VIRTIO_PCI_CAP_COMMON_CFG ||
+            cfg_type > VIRTIO_PCI_CAP_DEVICE_CFG) {
+            continue;
+        }
+        uint8_t bar = pci_read_config(PCI_CONFIG_ADDRESS(
+                          bus, device, function, cap + VIRTIO_PCI_CAP_BAR)) &
+                      0xFF;
+        if (bar >= PCI_MAX_BARS ||
+            (getBAR(bus, device, function, bar) & PCI_BAR_IO_SPACE)) {
+            continue;
+        }
+
+        uint32_t offset = pci_read_config(PCI_CONFIG_ADDRESS(
+            bus, device, function, cap + VIRTIO_PCI_CAP_OFFSET));
+        uint32_t length = pci_read_config(PCI_CONFIG_ADDRESS(
+            bus, device, function, cap + VIRTIO_PCI_CAP_LENGTH));
+        volatile uint8_t *region =
+            io_map(getBARAddress(bus, device, function, bar) + offset);
+
+        switch (cfg_type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!vdev->common)
+                    vdev->common =
+                        (volatile struct virtio_pci_common_cfg *)region;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!vdev->notify_base) {
+                    vdev->notify_base = region;
+                    vdev->notify_off_multiplier =
+                        pci_read_config(PCI_CONFIG_ADDRESS(
+                            bus, device, function,
+                            cap + VIRTIO_PCI_NOTIFY_CAP_MULT));
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!vdev->isr) vdev->isr = region;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!vdev->device_cfg) {
+                    vdev->device_cfg = region;
+                    vdev->device_cfg_len = length;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Legacy-only devices have no common configuration capability
+    if (!vdev->common || !vdev->notify_base) {
+        return false;
+    }
+
+    pci_enable_bus_master(bus, device, function);
+    if (checkMSIXCapability(bus, device, function, &vdev->msix_cap)) {
+        vdev->msix_table = getMSIXTable(bus, device, function, vdev->msix_cap);
+    }
+
+    // Reset, then wait for the device to report the reset as complete
+    vdev->common->device_status = 0;
+    while (vdev->common->device_status != 0) {
+    }
+    virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_set_status(vdev, VIRTIO_STATUS_DRIVER);
+    return true;
+}
+
+bool virtio_negotiate_features(struct virtio_device *vdev, uint64_t wanted) {
+    volatile struct virtio_pci_common_cfg *cfg = vdev->common;
+
+    cfg->device_feature_select = 0;
+    uint64_t offered = cfg->device_feature;
+    cfg->device_feature_select = 1;
+    offered |= (uint64_t)cfg->device_feature << 32;
+
+    uint64_t accepted = offered & (wanted | VIRTIO_FEATURE(VIRTIO_F_VERSION_1));
+    if (!(accepted & VIRTIO_FEATURE(VIRTIO_F_VERSION_1))) {
+        virtio_set_status(vdev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    cfg->driver_feature_select = 0;
+    cfg->driver_feature = (uint32_t)accepted;
+    cfg->driver_feature_select = 1;
+    cfg->driver_feature = (uint32_t)(accepted >> 32);
+
+    virtio_set_status(vdev, VIRTIO_STATUS_FEATURES_OK);
+    if (!(cfg->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        virtio_set_status(vdev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    vdev->features = accepted;
+    return true;
+}
+
+bool virtio_has_feature(const struct virtio_device *vdev, uint32_t bit) {
+    return (vdev->features & VIRTIO_FEATURE(bit)) != 0;
+}
+
+size_t virtq_mem_size(uint16_t num, bool packed) {
+    struct virtq_layout layout;
+    virtq_compute_layout(num, packed, &layout);
+    return layout.size;
+}
+
+bool virtq_setup(struct virtio_device *vdev, struct virtq *vq, uint16_t index,
+                 uint16_t num, void *mem, uint16_t msix_vector) {
+    volatile struct virtio_pci_common_cfg *cfg = vdev->common;
+    if (index >= cfg->num_queues) {
+        return false;
+    }
+
+    cfg->queue_select = index;
+    uint16_t max = cfg->queue_size;
+    if (max == 0 || cfg->queue_enable) {
+        return false;
+    }
+    if (num > max) {
+        num = max;
+    }
+    // The split ring indexes with num - 1 as a mask; clear low bits until
+    // a single one is left
+    while (num & (num - 1)) {
+        num &= num - 1;
+    }
+    if (num == 0) {
+        return false;
+    }
+    cfg->queue_size = num;
+
+    if (msix_vector != VIRTIO_MSI_NO_VECTOR) {
+        cfg->queue_msix_vector = msix_vector;
+        // The device answers NO_VECTOR if it could not allocate the entry
+        if (cfg->queue_msix_vector != msix_vector) {
+            return false;
+        }
+    }
+
+    bool packed = virtio_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    struct virtq_layout layout;
+    virtq_compute_layout(num, packed, &layout);
+
+    uint8_t *base = mem;
+    for (size_t i = 0; i < layout.size; i++) {
+        base[i] = 0;
+    }
+
+    *vq = (struct virtq){0};
+    vq->vdev = vdev;
+    vq->index = index;
+    vq->num = num;
+    vq->num_free = num;
+    vq->is_packed = packed;
+    vq->event_idx = virtio_has_feature(vdev, VIRTIO_F_EVENT_IDX);
+    vq->tokens = (void **)(base + layout.tokens);
+    vq->id_next = (uint16_t *)(base + layout.id_next);
+    vq->id_count = (uint16_t *)(base + layout.id_count);
+    vq->notify = (volatile uint16_t *)(vdev->notify_base +
+                                       cfg->queue_notify_off *
+                                           vdev->notify_off_multiplier);
+
+    if (packed) {
+        vq->packed.desc = (volatile struct virtq_packed_desc *)base;
+        vq->packed.driver =
+            (volatile struct virtq_event_suppress *)(base + layout.driver);
+        vq->packed.device =
+            (volatile struct virtq_event_suppress *)(base + layout.device);
+        vq->packed.avail_wrap = true;
+        vq->packed.used_wrap = true;
+        // Free buffer ids are chained through id_next
+        for (uint16_t i = 0; i < num; i++) {
+            vq->id_next[i] = i + 1;
+        }
+    } else {
+        vq->split.desc = (volatile struct virtq_desc *)base;
+        vq->split.avail = (volatile struct virtq_avail *)(base + layout.driver);
+        vq->split.used = (volatile struct virtq_used *)(base + layout.device);
+        // Free descriptors are chained through their next field
+        for (uint16_t i = 0; i < num; i++) {
+            vq->split.desc[i].next = i + 1;
+        }
+    }
+
+    uint64_t desc = VIRTIO_PHYS(base);
+    uint64_t driver = VIRTIO_PHYS(base + layout.driver);
+    uint64_t device = VIRTIO_PHYS(base + layout.device);
+    cfg->queue_desc_lo = (uint32_t)desc;
+    cfg->queue_desc_hi = (uint32_t)(desc >> 32);
+    cfg->queue_driver_lo = (uint32_t)driver;
+    cfg->queue_driver_hi = (uint32_t)(driver >> 32);
+    cfg->queue_device_lo = (uint32_t)device;
+    cfg->queue_device_hi = (uint32_t)(device >> 32);
+    cfg->queue_enable = 1;
+    return true;
+}
+
+bool virtio_msix_route(struct virtio_device *vdev, uint16_t entry,
+                       uint8_t apic_id, uint8_t idt_vector) {
+    if (!vdev->msix_cap) {
+        return false;
+    }
+    PERF_BEGIN(PERF_MSIX_SETUP);
+    writeMSIXTableEntry(vdev->msix_table, entry, MSI_ADDRESS(apic_id),
+                        idt_vector);
+    maskMSIXVector(vdev->msix_table, entry, false);
+    setMSIXEnable(vdev->bus, vdev->device, vdev->function, vdev->msix_cap,
+                  true);
+    PERF_END(PERF_MSIX_SETUP);
+    return true;
+}
+
+void virtio_driver_ok(struct virtio_device *vdev) {
+    virtio_set_status(vdev, VIRTIO_STATUS_DRIVER_OK);
+}
+
+static bool virtq_add_split(struct virtq *vq, const struct virtq_buf *bufs,
+                            uint16_t out, uint16_t total, void *token) {
+    uint16_t head = vq->free_head;
+    uint16_t idx = head;
+    for (uint16_t i = 0; i < total; i++) {
+        volatile struct virtq_desc *desc = &vq->split.desc[idx];
+        desc->addr = bufs[i].addr;
+        desc->len = bufs[i].len;
+        desc->flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                      (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0);
+        idx = desc->next;
+    }
+    vq->free_head = idx;
+    vq->tokens[head] = token;
+
+    // Fill the avail slot now; the index itself is only published on kick
+    vq->split.avail->ring[vq->split.avail_idx & (vq->num - 1)] = head;
+    vq->split.avail_idx++;
+    vq->num_added++;
+    return true;
+}
+
+static bool virtq_add_packed(struct virtq *vq, const struct virtq_buf *bufs,
+                             uint16_t out, uint16_t total, void *token) {
+    uint16_t id = vq->free_head;
+    uint16_t slot = vq->packed.next_avail;
+    uint16_t head = slot;
+    uint16_t head_flags = 0;
+    bool wrap = vq->packed.avail_wrap;
+
+    for (uint16_t i = 0; i < total; i++) {
+        volatile struct virtq_packed_desc *desc = &vq->packed.desc[slot];
+        uint16_t flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                         (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0) |
+                         (wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+        desc->addr = bufs[i].addr;
+        desc->len = bufs[i].len;
+        desc->id = id;
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            desc->flags = flags;
+        }
+        if (++slot == vq->num) {
+            slot = 0;
+            wrap = !wrap;
+        }
+    }
+
+    vq->free_head = vq->id_next[id];
+    vq->id_count[id] = total;
+    vq->tokens[id] = token;
+    vq->packed.next_avail = slot;
+    vq->packed.avail_wrap = wrap;
+    vq->num_added += total;
+
+    // The head flags make the whole chain visible, so they go last
+    virtio_barrier();
+    vq->packed.desc[head].flags = head_flags;
+    return true;
+}
+
+bool virtq_add(struct virtq *vq, const struct virtq_buf *bufs, uint16_t out,
+               uint16_t in, void *token) {
+    uint16_t total = out + in;
+    if (total == 0 || total > vq->num_free || !token) {
+        return false;
+    }
+    vq->num_free -= total;
+    if (vq->is_packed) {
+        return virtq_add_packed(vq, bufs, out, total, token);
+    }
+    return virtq_add_split(vq, bufs, out, total, token);
+}
+
+bool virtq_kick(struct virtq *vq) {
+    if (vq->num_added == 0) {
+        return false;
+    }
+
+    PERF_BEGIN(PERF_VIRTQ_KICK);
+    bool needed;
+    if (vq->is_packed) {
+        uint16_t new_idx = vq->packed.next_avail;
+        uint16_t old_idx = new_idx - vq->num_added;
+        vq->num_added = 0;
+        virtio_mb();
+
+        uint16_t off_wrap = vq->packed.device->off_wrap;
+        uint16_t flags = vq->packed.device->flags;
+        if (flags != VIRTQ_EVENT_F_DESC) {
+            needed = flags != VIRTQ_EVENT_F_DISABLE;
+        } else {
+            uint16_t event = off_wrap & 0x7FFF;
+            if ((bool)(off_wrap >> 15) != vq->packed.avail_wrap) {
+                event -= vq->num;
+            }
+            needed = vring_need_event(event, new_idx, old_idx);
+        }
+    } else {
+        uint16_t new_idx = vq->split.avail_idx;
+        uint16_t old_idx = new_idx - vq->num_added;
+        vq->num_added = 0;
+        virtio_barrier();
+        vq->split.avail->idx = new_idx;
+        virtio_mb();
+
+        if (vq->event_idx) {
+            // avail_event sits right after the used ring
+            volatile uint16_t *avail_event =
+                (volatile uint16_t *)(uintptr_t)&vq->split.used->ring[vq->num];
+            uint16_t event = *avail_event;
+            needed = vring_need_event(event, new_idx, old_idx);
+        } else {
+            needed = !(vq->split.used->flags & VIRTQ_USED_F_NO_NOTIFY);
+        }
+    }
+
+    if (needed) {
+        *vq->notify = vq->index;
+    }
+    PERF_END(PERF_VIRTQ_KICK);
+    return needed;
+}
+
+static bool virtq_packed_used(struct virtq *vq) {
+    uint16_t flags = vq->packed.desc[vq->last_used].flags;
+    bool avail = flags & VIRTQ_DESC_F_AVAIL;
+    bool used = flags & VIRTQ_DESC_F_USED;
+    return avail == used && used == vq->packed.used_wrap;
+}
+
+static bool virtq_has_used(struct virtq *vq) {
+    if (vq->is_packed) {
+        return virtq_packed_used(vq);
+    }
+    return vq->split.used->idx != vq->last_used;
+}
+
+void *virtq_get_used(struct virtq *vq, uint32_t *len) {
+    if (!virtq_has_used(vq)) {
+        return NULL;
+    }
+    virtio_barrier();
+
+    void *token;
+    if (vq->is_packed) {
+        volatile struct virtq_packed_desc *desc =
+            &vq->packed.desc[vq->last_used];
+        uint16_t id = desc->id;
+        if (len) *len = desc->len;
+
+        token = vq->tokens[id];
+        vq->tokens[id] = NULL;
+        vq->num_free += vq->id_count[id];
+        vq->last_used += vq->id_count[id];
+        if (vq->last_used >= vq->num) {
+            vq->last_used -= vq->num;
+            vq->packed.used_wrap = !vq->packed.used_wrap;
+        }
+        vq->id_next[id] = vq->free_head;
+        vq->free_head = id;
+
+        if (vq->event_idx && !vq->cb_disabled) {
+            vq->packed.driver->off_wrap =
+                vq->last_used | ((uint16_t)vq->packed.used_wrap << 15);
+        }
+    } else {
+        volatile struct virtq_used_elem *elem =
+            &vq->split.used->ring[vq->last_used & (vq->num - 1)];
+        uint16_t head = elem->id;
+        if (len) *len = elem->len;
+        vq->last_used++;
+
+        token = vq->tokens[head];
+        vq->tokens[head] = NULL;
+
+        // Return the chain to the free list
+        uint16_t idx = head;
+        uint16_t count = 1;
+        while (vq->split.desc[idx].flags & VIRTQ_DESC_F_NEXT) {
+            idx = vq->split.desc[idx].next;
+            count++;
+        }
+        vq->split.desc[idx].next = vq->free_head;
+        vq->free_head = head;
+        vq->num_free += count;
+
+        if (vq->event_idx && !vq->cb_disabled) {
+            vq->split.avail->ring[vq->num] = vq->last_used;
+        }
+    }
+    return token;
+}
+
+void virtq_disable_cb(struct virtq *vq) {
+    vq->cb_disabled = true;
+    if (vq->is_packed) {
+        vq->packed.driver->flags = VIRTQ_EVENT_F_DISABLE;
+    } else {
+        vq->split.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+bool virtq_enable_cb(struct virtq *vq) {
+    vq->cb_disabled = false;
+    if (vq->is_packed) {
+        if (vq->event_idx) {
+            vq->packed.driver->off_wrap =
+                vq->last_used | ((uint16_t)vq->packed.used_wrap << 15);
+            virtio_barrier();
+            vq->packed.driver->flags = VIRTQ_EVENT_F_DESC;
+        } else {
+            vq->packed.driver->flags = VIRTQ_EVENT_F_ENABLE;
+        }
+    } else {
+        vq->split.avail->flags = 0;
+        if (vq->event_idx) {
+            vq->split.avail->ring[vq->num] = vq->last_used;
+        }
+    }
+    // Completions that raced with re-enabling will not raise an interrupt
+    virtio_mb();
+    return !virtq_has_used(vq);
+}
+
+uint8_t virtio_read_isr(struct virtio_device *vdev) {
+    return vdev->isr ? *vdev->isr : 0;
+}
@@ -0,0 +1,332 @@
+/**
+ * @file virtio.h
+ * Released under MIT License
+ * You should have received a copy of the MIT License along with this program.
+ * If not, see <https://opensource.org/licenses/MIT>.
+ * @details virtio-pci modern (1.x) transport for bare-metal code on QEMU.
+ * Locates the common/notify/ISR/device configuration regions through the
+ * vendor-specific PCI capabilities, negotiates features and drives split or
+ * packed virtqueues with batched submission and notification suppression.
+ */
+#ifndef _DSP_VIRTIO_H_
+#define _DSP_VIRTIO_H_
+
+#include <pci.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIRTIO_PCI_VENDOR_ID 0x1AF4
+/* Modern-only devices use 0x1040 + virtio device type */
+#define VIRTIO_PCI_MODERN_DEVICE_BASE 0x1040
+#define VIRTIO_ID_NET 1
+#define VIRTIO_ID_BLOCK 2
+
+/* Vendor-specific capability (ID 0x09) layout */
+#define VIRTIO_PCI_CAP_ID 0x09
+#define VIRTIO_PCI_CAP_CFG_TYPE 3
+#define VIRTIO_PCI_CAP_BAR 4
+#define VIRTIO_PCI_CAP_OFFSET 8
+#define VIRTIO_PCI_CAP_LENGTH 12
+#define VIRTIO_PCI_NOTIFY_CAP_MULT 16
+
+/* cfg_type values */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+#define VIRTIO_PCI_CAP_PCI_CFG 5
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_NEEDS_RESET 64
+#define VIRTIO_STATUS_FAILED 128
+
+/* Transport feature bits */
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+#define VIRTIO_F_RING_PACKED 34
+#define VIRTIO_F_IN_ORDER 35
+#define VIRTIO_FEATURE(bit) (1ULL << (bit))
+
+/* Written to queue_msix_vector/msix_config to disable MSI-X delivery */
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+/* Descriptor flags (shared by split and packed rings) */
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+/* Packed ring only */
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
+
+/* Split ring suppression flags */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+/* Packed ring event suppression flags */
+#define VIRTQ_EVENT_F_ENABLE 0
+#define VIRTQ_EVENT_F_DISABLE 1
+#define VIRTQ_EVENT_F_DESC 2
+
+/* Common configuration structure (cfg_type 1) */
+struct virtio_pci_common_cfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    /* 64-bit fields are accessed as two 32-bit halves */
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+};
+
+/* Split ring structures */
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[]; /* followed by used_event */
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[]; /* followed by avail_event */
+};
+
+/* Packed ring structures */
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct virtq_event_suppress {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+/* A virtio-pci device located through its vendor capabilities */
+struct virtio_device {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *notify_base;
+    uint32_t notify_off_multiplier;
+    volatile uint8_t *isr;
+    volatile uint8_t *device_cfg;
+    uint32_t device_cfg_len;
+    /* MSI-X, valid when msix_cap is non-zero */
+    uint32_t msix_cap;
+    volatile uint32_t *msix_table;
+    uint64_t features;
+};
+
+/* One element of a descriptor chain handed to virtq_add */
+struct virtq_buf {
+    uint64_t addr;
+    uint32_t len;
+};
+
+/* A split or packed virtqueue. All fields are private to virtio.c. */
+struct virtq {
+    struct virtio_device *vdev;
+    volatile uint16_t *notify;
+    uint16_t index;
+    uint16_t num;
+    uint16_t num_free;
+    /* Buffers added since the last kick */
+    uint16_t num_added;
+    bool is_packed;
+    bool event_idx;
+    bool cb_disabled;
+    /* Per buffer state, indexed by head (split) or buffer id (packed) */
+    void **tokens;
+    uint16_t *id_next;
+    uint16_t *id_count;
+    uint16_t free_head;
+    uint16_t last_used;
+    union {
+        struct {
+            volatile struct virtq_desc *desc;
+            volatile struct virtq_avail *avail;
+            volatile struct virtq_used *used;
+            uint16_t avail_idx;
+        } split;
+        struct {
+            volatile struct virtq_packed_desc *desc;
+            volatile struct virtq_event_suppress *driver;
+            volatile struct virtq_event_suppress *device;
+            uint16_t next_avail;
+            bool avail_wrap;
+            bool used_wrap;
+        } packed;
+    };
+};
+
+/**
+ * @brief Locates the virtio-pci modern regions of a device and resets it.
+ * Parses the vendor-specific capabilities for the common, notify, ISR and
+ * device configuration structures, enables bus mastering, resets the device
+ * and sets the ACKNOWLEDGE and DRIVER status bits.
+ * @param vdev     The device structure to fill.
+ * @param bus      The bus number of the PCI device.
+ * @param device   The device number on the bus.
+ * @param function The function number of the device.
+ * @return true on success, false if the device is not a modern virtio device.
+ */
+bool virtio_pci_init(struct virtio_device *vdev, uint8_t bus, uint8_t device,
+                     uint8_t function);
+
+/**
+ * @brief Negotiates the feature set with the device.
+ * Accepts the intersection of the device features and @p wanted, always
+ * requesting VIRTIO_F_VERSION_1, then sets FEATURES_OK and checks that the
+ * device kept it. Include VIRTIO_F_EVENT_IDX and VIRTIO_F_RING_PACKED in
+ * @p wanted to use them where the device offers them.
+ * @param vdev   The device.
+ * @param wanted The features the driver supports.
+ * @return true if the device accepted the negotiated features.
+ */
+bool virtio_negotiate_features(struct virtio_device *vdev, uint64_t wanted);
+
+/**
+ * @brief Returns whether a feature was negotiated.
+ * @param vdev The device.
+ * @param bit  The feature bit number.
+ */
+bool virtio_has_feature(const struct virtio_device *vdev, uint32_t bit);
+
+/**
+ * @brief Computes how much memory a virtqueue needs.
+ * @param num    The queue size (a power of two).
+ * @param packed true for a packed ring, false for a split ring.
+ * @return The number of bytes virtq_setup needs in its @p mem argument.
+ */
+size_t virtq_mem_size(uint16_t num, bool packed);
+
+/**
+ * @brief Sets up and enables a virtqueue.
+ * The ring layout (packed or split) follows the negotiated features. @p mem
+ * must be 16 byte aligned, identity mapped and at least virtq_mem_size bytes
+ * long; it is cleared here.
+ * @param vdev        The device, after virtio_negotiate_features.
+ * @param vq          The queue structure to fill.
+ * @param index       The queue index.
+ * @param num         The requested queue size; clamped to the device maximum
+ *                    and rounded down to a power of two.
+ * @param mem         Backing memory for the rings and per-buffer state.
+ * @param msix_vector The MSI-X table entry for this queue, or
+ * VIRTIO_MSI_NO_VECTOR.
+ * @return true on success, false if the queue is unavailable or the device
+ * refused the MSI-X vector.
+ */
+bool virtq_setup(struct virtio_device *vdev, struct virtq *vq, uint16_t index,
+                 uint16_t num, void *mem, uint16_t msix_vector);
+
+/**
+ * @brief Routes an MSI-X table entry to a local APIC and IDT vector.
+ * Enables MSI-X on the device on first use and unmasks the entry.
+ * @param vdev       The device.
+ * @param entry      The MSI-X table entry (as passed to virtq_setup).
+ * @param apic_id    The destination local APIC ID.
+ * @param idt_vector The IDT vector to raise.
+ * @return false if the device has no MSI-X capability.
+ */
+bool virtio_msix_route(struct virtio_device *vdev, uint16_t entry,
+                       uint8_t apic_id, uint8_t idt_vector);
+
+/**
+ * @brief Sets DRIVER_OK, after which the device may use the queues.
+ * @param vdev The device.
+ */
+void virtio_driver_ok(struct virtio_device *vdev);
+
+/**
+ * @brief Queues one descriptor chain without notifying the device.
+ * The first @p out buffers are device-readable and the next @p in buffers are
+ * device-writable. The chain is only published by virtq_kick, so many
+ * requests can be batched behind a single notification.
+ * @param vq    The virtqueue.
+ * @param bufs  The chain, @p out + @p in entries long.
+ * @param out   The number of device-readable buffers.
+ * @param in    The number of device-writable buffers.
+ * @param token Non-NULL cookie returned by virtq_get_used on completion.
+ * @return false if the ring does not have enough free descriptors.
+ */
+bool virtq_add(struct virtq *vq, const struct virtq_buf *bufs, uint16_t out,
+               uint16_t in, void *token);
+
+/**
+ * @brief Publishes all chains added since the last kick.
+ * The device is only notified if it asked for it, using the avail/used event
+ * index when VIRTIO_F_EVENT_IDX was negotiated.
+ * @param vq The virtqueue.
+ * @return true if the device was notified.
+ */
+bool virtq_kick(struct virtq *vq);
+
+/**
+ * @brief Retrieves the next completed chain, if any.
+ * @param vq  The virtqueue.
+ * @param len If non-NULL, receives the number of bytes the device wrote.
+ * @return The token of the completed chain, or NULL if none is ready.
+ */
+void *virtq_get_used(struct virtq *vq, uint32_t *len);
+
+/**
+ * @brief Asks the device not to interrupt for this queue.
+ * Use while polling a busy queue.
+ * @param vq The virtqueue.
+ */
+void virtq_disable_cb(struct virtq *vq);
+
+/**
+ * @brief Re-enables interrupts for this queue.
+ * With VIRTIO_F_EVENT_IDX the device is asked to interrupt once the next
+ * buffer completes.
+ * @param vq The virtqueue.
+ * @return false if completions arrived in the meantime and the caller should
+ * poll again instead of waiting for an interrupt.
+ */
+bool virtq_enable_cb(struct virtq *vq);
+
+/**
+ * @brief Reads (and thereby acknowledges) the ISR status byte.
+ * Only needed when MSI-X is not in use.
+ * @param vdev The device.
+ * @return Bit 0: queue interrupt, bit 1: configuration change.
+ */
+uint8_t virtio_read_isr(struct virtio_device *vdev);
+
+#endif